@@ -12,5 +12,9 @@ rtos\kernel.c
 
 rtos\os.c
 
+rtos\timer.c
+
+rtos\trace.c
+
 uart\uart.c
 
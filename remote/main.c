@@ -3,12 +3,8 @@
 
 #define SEMIAUTO						//If uncommented, the robot will always drive forward if joystick is neutral. 
 
-//Global variables used for updating movement information 
-char direction = NOT_MOVING;
-char last_direction = NOT_MOVING;
-char speed = NOT_MOVING;
-char last_speed = NOT_MOVING;
-char fire = HOLD;
+//Commands received from the base station, in order
+MSGQ commands;
 
 //Global variables used for photoresistors and storing dead state
 uint16_t photores_thres;
@@ -53,38 +49,36 @@ void switch_uart_19200()
 
 void start_robot_safe()
 {
-	uart1_sendbyte(128);		//Send START command
-	uart1_sendbyte(131);		//Switch to SAFE mode
+	uint8_t cmd[] = {128, 131};		//Send START command, then switch to SAFE mode
+	
+	uart1_sendcmd(cmd, sizeof(cmd), UART_LANE_NORMAL);
 }
 
 void beep()
 {
 	//Play the beep "song" created in roomba_init
-	uart1_sendbyte(141);
-	uart1_sendbyte(0);
+	uint8_t cmd[] = {141, 0};
+	
+	uart1_sendcmd(cmd, sizeof(cmd), UART_LANE_NORMAL);
 }
 
 void roomba_init()
 {
-	//Default values
-	direction = NOT_MOVING;
-	speed = NOT_MOVING;
+	uint8_t song[] = {140, 0, 1, 62, 32};
 	
 	switch_uart_19200();
 	start_robot_safe();
 	
 	//Write a "song" for the beep into slot 0
 	//Example from: http://www.robotappstore.com/Knowledge-Base/4-How-to-Send-Commands-to-Roomba/18.html
-	uart1_sendbyte(140);
-	uart1_sendbyte(0);
-	uart1_sendbyte(1);
-	uart1_sendbyte(62);
-	uart1_sendbyte(32);
+	uart1_sendcmd(song, sizeof(song), UART_LANE_NORMAL);
 	beep();
 }
 
 void drive(int16_t vel, int16_t rad)
 {
+	uint8_t cmd[5];
+	
 	//Making sure velocity is within valid range
 	if(vel < -500) 
 		vel = -500;
@@ -97,26 +91,37 @@ void drive(int16_t vel, int16_t rad)
 	else if(rad > 2000 && rad != DRIVE_STRAIGHT)	//32767 and 32768 are special cases to drive straight
 		rad = 2000;
 	
-	uart1_sendbyte(137);				//Opcode for drive
-	uart1_sendbyte(vel >> 8);			//Velocity high byte
-	uart1_sendbyte(vel);				//velocity low byte
-	uart1_sendbyte(rad >> 8);			//Radius high byte
-	uart1_sendbyte(rad);				//Radius low byte
+	cmd[0] = 137;				//Opcode for drive
+	cmd[1] = vel >> 8;			//Velocity high byte
+	cmd[2] = vel;				//velocity low byte
+	cmd[3] = rad >> 8;			//Radius high byte
+	cmd[4] = rad;				//Radius low byte
+	
+	//Drive commands, stops included, go ahead of queued queries and songs. They all share the urgent lane, so they still go out in order.
+	uart1_sendcmd(cmd, sizeof(cmd), UART_LANE_URGENT);
 }
 
 void movement_controller()
 {
 	int16_t vel;
 	int16_t rad;
+	COMMAND *cmd;
+	char last_direction = NOT_MOVING;
+	char last_speed = NOT_MOVING;
 	
 	while (1)
 	{
+		//Wait for the next command from the base station
+		cmd = MsgQ_Receive(commands);
+		
 		//If the base station hasn't issued a new direction or speed, skip updating
-		if (direction == last_direction && speed == last_speed)
+		if (cmd->direction == last_direction && cmd->speed == last_speed)
 			goto move_as_global_continue;
+		last_direction = cmd->direction;
+		last_speed = cmd->speed;
 		
 		//Decode the direction sent by the base station
-		switch(direction)
+		switch(cmd->direction)
 		{
 			case NEGATIVE_HIGH:
 				rad = BACKWARDS_FAST_RAD;
@@ -137,7 +142,7 @@ void movement_controller()
 		}
 	
 		//Decode the speed sent by the base station
-		switch(speed)
+		switch(cmd->speed)
 		{
 			case NEGATIVE_HIGH:
 				vel = BACKWARDS_FAST;
@@ -173,14 +178,24 @@ void movement_controller()
 		drive(vel, rad);
 
 move_as_global_continue:
-		if (fire == HOLD)
+		if (cmd->fire == HOLD)
 			PORTB &= ~(1<<PB2);	//pin 51 off
-		else if (fire == FIRE)
+		else if (cmd->fire == FIRE)
 			PORTB |= (1<<PB2);	//pin 51 on
-		Task_Sleep(3);
+		Msg_Free(cmd);
 	}
 }
 
+/*Sleeps until the next release of a periodic task. Releases stay on multiples of the period, and the ones an overrun has missed are skipped rather than caught up on.*/
+void wait_next_release(TICK *release, TICK period)
+{
+	do
+		*release += period;
+	while((int)(OS_GetTicks() - *release) > 0);
+	
+	Task_Sleep_Until(*release);
+}
+
 int isHit()
 {
 	uint16_t val = readadc(PHOTORESIS_PIN); 
@@ -191,15 +206,15 @@ void handle_sensors()
 {
 	uint8_t i;
 	uint8_t bytes[SENSORS_TO_QUERY + TWO_BYTE_SENSORS];	
+	uint8_t query[] = {149, SENSORS_TO_QUERY, 7, 13};	//Query List of SENSORS_TO_QUERY packets. Packet 7: Bump/Wheeldrop detection, packet 13: Virtual wall seen?
+	uint8_t dead[] = {164, 68, 69, 65, 68, 128};		//Write "DEAD" on the front LEDs, then the start command to go to passive mode
+	TICK release = OS_GetTicks();
 	
 	while(1)
 	{
 		/*Queries the sensors*/
 		
-		uart1_sendbyte(149);				//Opcode for Query List
-		uart1_sendbyte(SENSORS_TO_QUERY);	//Query will send three sensors packets
-		uart1_sendbyte(7);					//Packet 7: Bump/Wheeldrop detection
-		uart1_sendbyte(13);					//Packet 13: Virtual wall seen?
+		uart1_sendcmd(query, sizeof(query), UART_LANE_NORMAL);
 	
 		Task_Sleep(2);						//End of upper half of handle_sensor and wait for Roomba to reply with sensor data
 		
@@ -210,15 +225,8 @@ void handle_sensors()
 			drive(0,0);
 			beep();
 			
-			//Write "DEAD" on the front LEDs
-			uart1_sendbyte(164);
-			uart1_sendbyte(68);
-			uart1_sendbyte(69);
-			uart1_sendbyte(65);
-			uart1_sendbyte(68);
-			
-			//Send the start command to go to passive mode and act dead
-			uart1_sendbyte(128);	
+			//Write "DEAD" on the front LEDs and go to passive mode to act dead
+			uart1_sendcmd(dead, sizeof(dead), UART_LANE_NORMAL);
 			//Task_Terminate();
 		}
 	
@@ -261,7 +269,7 @@ void handle_sensors()
 			_delay_ms(2000);
 			drive(0,0);
 		}
-		Task_Sleep(3);
+		wait_next_release(&release, SENSOR_PERIOD);
 	}
 }
 
@@ -269,6 +277,8 @@ int receive_and_update()
 {
 	uint8_t curbyte;
 	uint8_t count;
+	COMMAND *cmd;
+	TICK release = OS_GetTicks();
 	
 	while(1)
 	{
@@ -284,17 +294,17 @@ int receive_and_update()
 			curbyte = uart0_recvbyte();
 		}
 		
-		//Save current speed and direction
-		last_direction = direction;
-		last_speed = speed;
-		
 		//When preamble is received, receive the subsequent bytes containing new data for control
-		direction = uart0_recvbyte();
-		speed = uart0_recvbyte();
-		fire = uart0_recvbyte();
+		cmd = Msg_Alloc();
+		cmd->direction = uart0_recvbyte();
+		cmd->speed = uart0_recvbyte();
+		cmd->fire = uart0_recvbyte();
+		
+		//Hand the buffer over to the movement controller, waiting if it's still busy with earlier commands
+		MsgQ_Send(commands, cmd);
 		
 receive_and_update_continue:
-		Task_Sleep(8);	
+		wait_next_release(&release, RADIO_PERIOD);
 	}
 }
 
@@ -303,6 +313,7 @@ void a_main()
 	DDRB |= (1<<PB2);	//pin 51 set as output for laser
 	
 	OS_Init();
+	commands = MsgQ_Init(CMD_QUEUE_LENG);
 	
 	InitADC();
 	uart0_init();		//UART0 is used for BT
@@ -311,9 +322,9 @@ void a_main()
 	calibratePhotores();
 	beep();
 	
-	Task_Create(receive_and_update, 4, 0);
-	Task_Create(movement_controller, 5, 0);
-	Task_Create(handle_sensors, 3, 0);
+	Task_Create(receive_and_update, 4, 0, RADIO_STACK_SIZE);
+	Task_Create(movement_controller, 5, 0, MOVEMENT_STACK_SIZE);
+	Task_Create(handle_sensors, 3, 0, SENSORS_STACK_SIZE);
 	
 	OS_Start();
 }
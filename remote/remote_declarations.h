@@ -16,5 +16,24 @@
 #define PHOTORESIS_PIN   0		//photosensor pin on A0
 
 #define MAX_CMD_LENG	6
+#define CMD_QUEUE_LENG	2		//Commands the radio task may get ahead of the movement controller
+
+//Periods of the periodic tasks, in ticks
+#define SENSOR_PERIOD	5
+#define RADIO_PERIOD	8
+
+//Stack sizes of the tasks in bytes. Each has to hold the task's deepest call chain into the UART and kernel API (about 45-60 bytes),
+//a full interrupt frame with the call to Kernel_Tick_ISR on top of it (about 65 bytes), and the canary. Check them against Task_GetStackUsage().
+#define RADIO_STACK_SIZE	160
+#define MOVEMENT_STACK_SIZE	160
+#define SENSORS_STACK_SIZE	192
+
+//A command from the base station, passed from the radio task to the movement controller in a message buffer
+typedef struct command
+{
+	char direction;
+	char speed;
+	char fire;
+} COMMAND;
 
 #endif /* REMOTE_DECLARATIONS_H_ */
\ No newline at end of file
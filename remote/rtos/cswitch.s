@@ -116,65 +116,129 @@ EIND   = 0X3C
 	pop	r1
 	pop	r0
 .endm
+;
+; Push only the registers a C function must preserve across a call
+; (r2-r17, r28, r29 in the avr-gcc ABI), then the status register.
+; This is all that needs saving when the context is left through a normal
+; function call, i.e., a voluntary syscall or the kernel calling
+; Exit_Kernel(). r1 is always zero at that point, and every other
+; register is already considered clobbered by the caller.
+;
+.macro	SAVECTX_LIGHT
+	push	r2
+	push	r3
+	push	r4
+	push	r5
+	push	r6
+	push	r7
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+	push	r12
+	push	r13
+	push	r14
+	push	r15
+	push	r16
+	push	r17
+	push	r28
+	push	r29
+
+	in		r0, SREG		/*r0 is a scratch register in the avr-gcc ABI*/
+	push	r0				/*Push SREG into the stack*/
+.endm
+;
+; Pop the registers pushed by SAVECTX_LIGHT
+;
+.macro	RESTORECTX_LIGHT
+	pop		r0				/*Pop the top of the stack containing SREG into R0*/
+	out		SREG, r0
+
+	pop	r29
+	pop	r28
+	pop	r17
+	pop	r16
+	pop	r15
+	pop	r14
+	pop	r13
+	pop	r12
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	pop	r7
+	pop	r6
+	pop	r5
+	pop	r4
+	pop	r3
+	pop	r2
+.endm
+
+/*
+  * A saved task context is either "light" (SAVECTX_LIGHT, from a voluntary
+  * syscall) or "full" (SAVECTX, from an interrupt). The type is pushed on 
+  * top of the frame, so the context can be restored the same way it was saved.
+  * The initial context built by Kernel_Create_Task() is a light frame.
+  * These values must match LIGHT_FRAME/FULL_FRAME in kernel.h.
+  */
+LIGHT_FRAME = 0
+FULL_FRAME  = 1
+
+/*
+  * Results of Kernel_Handle_Request(). These values must match 
+  * KEEP_RUNNING/SWITCH_SAVE/SWITCH_DISCARD in kernel.h.
+  */
+KEEP_RUNNING   = 0
+SWITCH_SAVE    = 1
+SWITCH_DISCARD = 2
 
         .section .text
         .global CSwitch
         .global Exit_Kernel
         .global Enter_Kernel
+        .global __vector_17
         .extern  KernelSp
         .extern  CurrentSp
+        .extern  Kernel_Handle_Request
+        .extern  Kernel_Switch_Task
+        .extern  Kernel_Tick_ISR
 /*
   * The actual CSwitch() code begins here.
   *
-  * This function is called by the kernel. Upon entry, we are using
-  * the kernel stack, on top of which contains the return address 
-  * of the call to CSwitch() (or Exit_Kernel()).
-  * 
-  * Assumption: Our kernel is executed with interrupts already disabled.
+  * The kernel has no context of its own. Each request is handled by
+  * calling Kernel_Handle_Request() on an empty kernel stack (KernelSp), and
+  * we go straight from the context of the task that entered the kernel
+  * to the context of the next task.
   *
   * Note: AVR devices use LITTLE endian format, i.e., a 16-bit value starts
   * with the lower-order byte first, then the higher-order byte.
+  */
+
+/*
+  * This function is called once by OS_Start() to run the first task (Cp),
+  * whose stack pointer is in CurrentSp. The stack OS_Start() runs on 
+  * becomes the kernel stack; everything already on it is kept.
+  *
+  * Assumption: Our kernel is executed with interrupts already disabled.
   *
   * void CSwitch();
   * void Exit_Kernel(); 
   */
 CSwitch:
 Exit_Kernel:
-        /* 
-          * This is the "top" half of CSwitch(), generally called by the kernel.
-          * Assume I = 0, i.e., all interrupts are disabled.
-          */
-        SAVECTX
-        /* 
-          * Now, we have saved the kernel's context.
-          * Save the current H/W stack pointer into KernelSp.
-          */
         in   r30, SPL
         in   r31, SPH
         sts  KernelSp, r30
         sts  KernelSp+1, r31
-        /*
-          * We are now ready to restore Cp's context, i.e.,
-          * switching the H/W stack pointer to CurrentSp.
-          */ 
-        lds  r30, CurrentSp
-        lds  r31, CurrentSp+1
-        out  SPL, r30
-        out  SPH, r31
-        /*
-          * We are now executing in Cp's stack.
-          * Note: at the bottom of the Cp's context is its return address.
-          */
-        RESTORECTX
-        reti         /* re-enable all global interrupts */
+        rjmp Restore_Task
+
 /*
   * All system call eventually enters here!
   * There are two possibilities how we get here: 
   *  1) Cp explicitly invokes one of the kernel API call stub, which indirectly
   *       invoke Enter_Kernel().
-  *  2) a timer interrupt, which somehow "jumps" into here.
-  * Let us consider case (1) first. You have to figure out how to deal with
-  * timer interrupts yourself.
+  *  2) a timer interrupt (see __vector_17 below).
+  * Let us consider case (1) first.
   *
   * Assumption: All interrupts are disabled upon entering here, and
   *     we are still executing on Cp's stack. The return address of
@@ -183,35 +247,126 @@ Exit_Kernel:
   * void Enter_Kernel();
   */
 Enter_Kernel:   
+        /* 
+          * Nothing needs saving yet: the kernel is a C function, so it
+          * preserves Cp's call-saved registers for us, and the others are 
+          * already considered clobbered by Cp.
+          * Save the current H/W stack pointer into CurrentSp and handle the
+          * request on the kernel's stack.
+          */
+        in   r30, SPL
+        in   r31, SPH
+        sts  CurrentSp, r30
+        sts  CurrentSp+1, r31
+        lds  r30, KernelSp
+        lds  r31, KernelSp+1
+        out  SPL, r30
+        out  SPH, r31
+        call Kernel_Handle_Request
+        cpi  r24, KEEP_RUNNING
+        brne 1f
         /*
-          * This is the "bottom" half of CSwitch(). We are still executing in
-          * Cp's context.
+          * Cp keeps running: its registers haven't been touched, so just
+          * return to it. We use "reti" to re-enable all global interrupts.
           */
-        SAVECTX
-        /* 
-          * Now, we have saved the Cp's context.
-          * Save the current H/W stack pointer into CurrentSp.
+        lds  r30, CurrentSp
+        lds  r31, CurrentSp+1
+        out  SPL, r30
+        out  SPH, r31
+        reti
+1:
+        /*
+          * Cp is dead and never runs again, so its context isn't saved.
+          * It may have been terminated for overflowing its stack, and 
+          * pushing onto it would corrupt the memory below.
           */
+        cpi  r24, SWITCH_DISCARD
+        breq Switch_Task
+        /*
+          * Another task has been dispatched. Save Cp's light context on 
+          * its own stack, then switch straight to the new task.
+          */
+        lds  r30, CurrentSp
+        lds  r31, CurrentSp+1
+        out  SPL, r30
+        out  SPH, r31
+        SAVECTX_LIGHT
+        ldi  r31, LIGHT_FRAME
+        push r31
         in   r30, SPL
         in   r31, SPH
         sts  CurrentSp, r30
         sts  CurrentSp+1, r31
+Switch_Task:
         /*
-          * We are now ready to restore kernel's context, i.e.,
-          * switching the H/W stack pointer back to KernelSp.
-          */ 
+          * The context of the previous task is saved and CurrentSp points to it.
+          * Let the kernel store it, and load the stack pointer of the new Cp into CurrentSp.
+          */
         lds  r30, KernelSp
         lds  r31, KernelSp+1
         out  SPL, r30
         out  SPH, r31
+        call Kernel_Switch_Task
+Restore_Task:
         /*
-          * We are now executing in kernel's stack.
-          */
-       RESTORECTX
-        /* 
-          * We are ready to return to the caller of CSwitch() (or Exit_Kernel()).
-          * Note: We should NOT re-enable interrupts while kernel is running.
-          *         Therefore, we use "ret", and not "reti".
+          * Switch the H/W stack pointer to CurrentSp. We are now executing in Cp's stack.
+          * Restore its context according to the frame type on top.
+          * r31 is either restored by RESTORECTX or clobbered by the syscall anyway.
+          * Note: at the bottom of the Cp's context is its return address.
           */
-       ret
+        lds  r30, CurrentSp
+        lds  r31, CurrentSp+1
+        out  SPL, r30
+        out  SPH, r31
+        pop  r31
+        cpi  r31, LIGHT_FRAME
+        brne 2f
+        RESTORECTX_LIGHT
+        reti         /* re-enable all global interrupts */
+2:
+        RESTORECTX
+        reti         /* re-enable all global interrupts */
 /* end of CSwitch() */
+
+/*
+  * Timer tick interrupt, i.e., case (2) above.
+  *
+  * The interrupted task may be anywhere in its code, so its full context
+  * is saved, and the return address on the stack is the interrupted instruction. 
+  * Kernel_Tick_ISR() then decides whether Cp has to trap into the kernel.
+  * If so, the frame is marked as full and the kernel handles a PREEMPT
+  * request for Cp, exactly like Enter_Kernel() does.
+  * Otherwise (e.g. the kernel itself was idling), we simply return.
+  *
+  * Assumption: I = 0 on entry, as set by the hardware.
+  *
+  * This is TIMER1_COMPA_vect of the ATmega2560. That name is a macro of 
+  * <avr/io.h>, which this file doesn't include since its register macros 
+  * would clash with the symbols above, so the vector is named directly.
+  */
+__vector_17:
+        SAVECTX
+        clr  r1                         /* C code expects r1 to be zero */
+        call Kernel_Tick_ISR
+        tst  r24                        /* non-zero return value = trap into kernel */
+        brne 3f
+        RESTORECTX
+        reti
+3:
+        ldi  r31, FULL_FRAME
+        push r31
+        in   r30, SPL
+        in   r31, SPH
+        sts  CurrentSp, r30
+        sts  CurrentSp+1, r31
+        lds  r30, KernelSp
+        lds  r31, KernelSp+1
+        out  SPL, r30
+        out  SPH, r31
+        call Kernel_Handle_Request
+        tst  r24
+        breq 4f
+        rjmp Switch_Task                /* the full context is already saved */
+4:
+        rjmp Restore_Task               /* Cp keeps running */
+/* end of __vector_17 */
@@ -1,52 +1,105 @@
+#include <avr/sleep.h>
+#include <string.h>
+#include <stddef.h>
 #include "kernel.h"
+#include "trace.h"
 
 /*Context Switching functions defined in cswitch.s*/
-extern void CSwitch();
 extern void Exit_Kernel();
 
+//Task field of a trace record: the slot index of the task
+#define TRACE_TASK(p) HANDLE_INDEX((p)->pid)
+
 /*System variables used by the kernel only*/
 volatile static PD Process[MAXTHREAD];			//Contains the process descriptor for all tasks, regardless of their current state.
 volatile static EVENT_TYPE Event[MAXEVENT];		//Contains all the event objects 
 volatile static MUTEX_TYPE Mutex[MAXMUTEX];		//Contains all the mutex objects
+volatile static SEM_TYPE Sem[MAXSEM];			//Contains all the semaphore objects
+volatile static MSGQ_TYPE MsgQ[MAXMSGQ];		//Contains all the message queue objects
+static MSG_BUFFER Msg_Pool[MSG_POOL_SIZE];		//Memory that all message buffers are taken from
+static MSG_BUFFER *Free_Msgs;					//Buffers of Msg_Pool that aren't owned by any task or queue
+volatile static PD_QUEUE Msg_Waiters;			//Tasks waiting for a free buffer, highest priority first
+volatile static FLAGS_TYPE Flags[MAXFLAGS];		//Contains all the event flag groups
+static unsigned char Stack_Pool[STACK_POOL_SIZE];	//Memory that the stacks of all tasks are allocated from
+static STACK_BLOCK *Free_Stacks;				//Free blocks of Stack_Pool, ordered by address
 
-volatile static unsigned int NextP;				//Which task in the process queue to dispatch next.
+volatile static PD_QUEUE Ready_Queue[LOWEST_PRIORITY+1];	//A FIFO of READY tasks for each priority level. Tasks are served round-robin within a level.
+volatile static unsigned int Ready_Bitmap;		//Bit n is set whenever Ready_Queue[n] is not empty.
+volatile static PD *Switched_From;				//The task that entered the kernel, whose context has to be saved if another task is dispatched.
 volatile static unsigned int Task_Count;		//Number of tasks created so far.
 volatile static unsigned int Event_Count;		//Number of events created so far.
 volatile static unsigned int Mutex_Count;		//Number of Mutexes created so far.
+volatile static unsigned int Sem_Count;			//Number of semaphores created so far.
+volatile static unsigned int MsgQ_Count;		//Number of message queues created so far.
+volatile static unsigned int Flags_Count;		//Number of event flag groups created so far.
 volatile static unsigned int Tick_Count;		//Number of timer ticks missed
+volatile static ISR_REQUEST ISR_Queue[ISR_QUEUE_SIZE];	//Ring buffer of requests made by interrupt handlers, waiting to be carried out by the kernel
+volatile static unsigned char ISR_Queue_Head;	//Index of the oldest request in ISR_Queue, only advanced by the kernel
+volatile static unsigned char ISR_Queue_Tail;	//Index of the next free entry in ISR_Queue, only advanced by interrupt handlers
+volatile static unsigned int ISR_Queue_Dropped;	//Number of ISR requests lost because ISR_Queue was full
+volatile static PD *Sleep_Queue;				//Delta list of SLEEPING tasks ordered by wake-up time. Each task stores its wake time relative to the one before it.
+volatile static PD *Deadline_Queue;				//Periodic tasks whose current job is unfinished and hasn't missed its deadline yet, nearest deadline first
+volatile static unsigned char Kernel_Idle;		//Set while the kernel waits for a task to become ready with interrupts enabled
+volatile static unsigned char Tick_Period;		//Number of ticks the current Timer1 period stands for. Only larger than 1 while the kernel is idle.
+static const unsigned char Time_Slice[LOWEST_PRIORITY+1] = TIME_SLICE;	//Length of a time slice in ticks for each priority level
+volatile static unsigned long Elapsed_Ticks;	//Number of ticks processed by the kernel since OS_Start(). Tick_Count holds the ones not processed yet.
+volatile static unsigned long Run_Start;		//Time (see Kernel_Now) since when the CPU time hasn't been charged to anyone
+volatile static unsigned long Idle_Time;		//Total time the kernel has spent idle, in Timer1 counts
+volatile static unsigned long Idle_Window_Mark;	//Idle_Time when the current utilisation window started
+volatile static unsigned long Idle_Last_Window;	//Time spent idle during the previous utilisation window
+volatile static unsigned long Window_Start;		//Time the current utilisation window started
+static missfuncptr Miss_Handler;				//Called whenever a periodic job misses its deadline, see setDeadlineMissHandler()
+#ifdef EDF_SCHEDULING
+volatile static unsigned long Edf_Load;			//Processor demand of all periodic tasks, EDF_FULL_LOAD = the whole CPU
+#endif
+#ifdef OS_STATS
+volatile static KERNEL_STATS Stats;				//Request latencies and scheduler counters, see getKernelStats()
+volatile static unsigned int Stats_Stamp;		//TCNT1 when the time of the current request was last taken
+volatile static unsigned int Stats_Elapsed;		//Timer1 counts spent so far on the current request
+#endif
 
 /*Variables accessible by OS*/
 volatile PD* Cp;		
-volatile unsigned char *KernelSp;				//Pointer to the Kernel's own stack location.
-volatile unsigned char *CurrentSp;				//Pointer to the stack location of the current running task. Used for saving into PD during ctxswitch.						//The process descriptor of the currently RUNNING task. CP is used to pass information from OS calls to the kernel telling it what to do.
+volatile unsigned char *KernelSp;				//Pointer to the base of the Kernel's own stack. Requests are handled there, starting from scratch every time.
+volatile unsigned char *CurrentSp;				//Pointer to the stack location of the task being switched. Used for saving into PD during ctxswitch.						//The process descriptor of the currently RUNNING task. CP is used to pass information from OS calls to the kernel telling it what to do.
 volatile unsigned int KernelActive;				//Indicates if kernel has been initialzied by OS_Start().
-volatile unsigned int Last_PID;					//Last (also highest) PID value created so far.
-volatile unsigned int Last_EventID;				//Last (also highest) EVENT value created so far.
-volatile unsigned int Last_MutexID;				//Last (also highest) MUTEX value created so far.
+volatile unsigned int Last_PID;					//PID of the last task created.
+volatile unsigned int Last_EventID;				//EVENT handle of the last event created.
+volatile unsigned int Last_MutexID;				//MUTEX handle of the last mutex created.
+volatile unsigned int Last_SemID;				//SEMAPHORE handle of the last semaphore created.
+volatile unsigned int Last_MsgQID;				//MSGQ handle of the last message queue created.
+volatile unsigned int Last_FlagsID;				//FLAGS handle of the last event flag group created.
 volatile ERROR_TYPE err;						//Error code for the previous kernel operation (if any)
+volatile unsigned long Idle_Ticks;				//Number of ticks the kernel has spent sleeping because no task was ready
 
 
 /************************************************************************/
 /*						  KERNEL-ONLY HELPERS                           */
 /************************************************************************/
 
-/*Returns the pointer of a process descriptor in the global process list, by searching for its PID*/
-PD* findProcessByPID(int pid)
+/*Builds a new handle for a table slot. The slot's generation is bumped (skipping 0), so any handle given out for its previous occupant no longer matches.*/
+static unsigned int New_Handle(volatile unsigned char *gen, unsigned int index)
 {
-	int i;
+	if(++(*gen) == 0)
+		*gen = 1;
 	
-	//Valid PIDs must be greater than 0.
-	if(pid <=0)
-	return NULL;
+	return MAKE_HANDLE(*gen, index);
+}
+
+/*Returns the pointer of a process descriptor in the global process list, by looking up the slot its PID refers to*/
+PD* findProcessByPID(PID pid)
+{
+	PD *p;
 	
-	for(i=0; i<MAXTHREAD; i++)
-	{
-		if (Process[i].pid == pid)
-		return &(Process[i]);
-	}
+	if(HANDLE_INDEX(pid) >= MAXTHREAD)
+		return NULL;
 	
-	//No process with such PID
-	return NULL;
+	//The PID must still be the one of the task in that slot, which is 0 (never a valid PID) for unused slots
+	p = (PD*)&Process[HANDLE_INDEX(pid)];
+	if(p->pid != pid || p->state == DEAD)
+		return NULL;
+	
+	return p;
 }
 
 EVENT_TYPE* findEventByEventID(EVENT e)
@@ -64,11 +117,9 @@ EVENT_TYPE* findEventByEventID(EVENT e)
 	}
 	
 	//Find the requested Event and return its pointer if found
-	for(i=0; i<MAXEVENT; i++)
-	{
-		if(Event[i].id == e) 
-			return &Event[i];
-	}
+	i = HANDLE_INDEX(e);
+	if(i < MAXEVENT && Event[i].id == e) 
+		return (EVENT_TYPE*)&Event[i];
 	
 	//Event wasn't found
 	//#ifdef OS_DEBUG
@@ -93,11 +144,9 @@ MUTEX_TYPE* findMutexByMutexID(MUTEX m)
 	}
 	
 	//Find the requested Mutex and return its pointer if found
-	for(i=0; i<MAXMUTEX; i++)
-	{
-		if(Mutex[i].id == m)
-		return &Mutex[i];
-	}
+	i = HANDLE_INDEX(m);
+	if(i < MAXMUTEX && Mutex[i].id == m)
+		return (MUTEX_TYPE*)&Mutex[i];
 	
 	//mutex wasn't found
 	//#ifdef OS_DEBUG
@@ -107,502 +156,2189 @@ MUTEX_TYPE* findMutexByMutexID(MUTEX m)
 	return NULL;
 }
 
-/************************************************************************/
-/*				   		       OS HELPERS                               */
-/************************************************************************/
+SEM_TYPE* findSemBySemID(SEMAPHORE s)
+{
+	int i;
+	
+	//Ensure the request semaphore ID is > 0
+	if(s == 0)
+	{
+		#ifdef OS_DEBUG
+		printf("findSemBySemID: The specified semaphore ID is invalid!\n");
+		#endif
+		err = INVALID_ARG_ERR;
+		return NULL;
+	}
+	
+	//Find the requested semaphore and return its pointer if found
+	i = HANDLE_INDEX(s);
+	if(i < MAXSEM && Sem[i].id == s)
+		return (SEM_TYPE*)&Sem[i];
+	
+	err = SEM_NOT_FOUND_ERR;
+	return NULL;
+}
 
-/*Returns the PID associated with a function's memory address*/
-int findPIDByFuncPtr(voidfuncptr f)
+MSGQ_TYPE* findMsgQByMsgQID(MSGQ q)
 {
 	int i;
 	
-	for(i=0; i<MAXTHREAD; i++)
+	//Ensure the request queue ID is > 0
+	if(q == 0)
 	{
-		if (Process[i].code == f)
-			return Process[i].pid;
+		#ifdef OS_DEBUG
+		printf("findMsgQByMsgQID: The specified message queue ID is invalid!\n");
+		#endif
+		err = INVALID_ARG_ERR;
+		return NULL;
 	}
 	
-	//No process with such PID
-	return -1;
+	//Find the requested queue and return its pointer if found
+	i = HANDLE_INDEX(q);
+	if(i < MAXMSGQ && MsgQ[i].id == q)
+		return (MSGQ_TYPE*)&MsgQ[i];
+	
+	err = MSGQ_NOT_FOUND_ERR;
+	return NULL;
 }
 
-/*Only useful if our RTOS allows more than one missed event signals to be recorded*/
-int getEventCount(EVENT e)
+FLAGS_TYPE* findFlagsByFlagsID(FLAGS f)
 {
-	EVENT_TYPE* e1 = findEventByEventID(e);
+	int i;
 	
-	if(e1 == NULL) 
-		return 0;
-		
-	return e1->count;	
+	//Ensure the request group ID is > 0
+	if(f == 0)
+	{
+		#ifdef OS_DEBUG
+		printf("findFlagsByFlagsID: The specified event flag group ID is invalid!\n");
+		#endif
+		err = INVALID_ARG_ERR;
+		return NULL;
+	}
+	
+	//Find the requested group and return its pointer if found
+	i = HANDLE_INDEX(f);
+	if(i < MAXFLAGS && Flags[i].id == f)
+		return (FLAGS_TYPE*)&Flags[i];
+	
+	err = FLAGS_NOT_FOUND_ERR;
+	return NULL;
 }
 
 /************************************************************************/
-/*                  ISR FOR HANDLING SLEEP TICKS                        */
+/*						  READY QUEUE HELPERS                           */
 /************************************************************************/
 
-//Timer tick ISR
-ISR(TIMER1_COMPA_vect)
+//Index of the lowest set bit for every 4-bit value, used to find the highest ready priority without looping
+static const unsigned char Lowest_Bit[16] = {0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
+
+/*Appends a task to the tail of a queue*/
+static void Queue_Append(volatile PD_QUEUE *q, PD *p)
+{
+	p->next = NULL;
+	p->prev = q->tail;
+	
+	if(q->tail == NULL)
+		q->head = p;
+	else
+		q->tail->next = p;
+	q->tail = p;
+}
+
+/*Unlinks a task from anywhere inside a queue*/
+static void Queue_Remove(volatile PD_QUEUE *q, PD *p)
 {
-	++Tick_Count;
+	if(p->prev == NULL)
+		q->head = p->next;
+	else
+		p->prev->next = p->next;
+	
+	if(p->next == NULL)
+		q->tail = p->prev;
+	else
+		p->next->prev = p->prev;
+	
+	p->next = NULL;
+	p->prev = NULL;
 }
 
-//Processes all tasks that are currently sleeping and decrement their sleep ticks when called. Expired sleep tasks are placed back into their old state
-void Kernel_Tick_Handler()
+/*Inserts a task into a queue kept in priority order, behind the tasks of the same or a higher priority*/
+static void Queue_Insert_Priority(volatile PD_QUEUE *q, PD *p)
 {
-	int i;
+	PD *before = q->tail;
 	
-	//No ticks has been issued yet, skipping...
-	if(Tick_Count == 0)
-		return;
+	while(before != NULL && before->pri > p->pri)
+		before = before->prev;
 	
-	for(i=0; i<MAXTHREAD; i++)
+	//Every queued task has a lower priority, so p goes first
+	if(before == NULL)
 	{
-		//Process any active tasks that are sleeping
-		if(Process[i].state == SLEEPING)
-		{
-			//If the current sleeping task's tick count expires, put it back into its READY state
-			Process[i].request_arg -= Tick_Count;
-			if(Process[i].request_arg <= 0)
-			{
-				Process[i].state = READY;
-				Process[i].request_arg = 0;
-			}
-		}
-		
-		//Process any SUSPENDED tasks that were previously sleeping
-		else if(Process[i].last_state == SLEEPING)
-		{
-			//When task_resume is called again, the task will be back into its READY state instead if its sleep ticks expired.
-			Process[i].request_arg -= Tick_Count;
-			if(Process[i].request_arg <= 0)
-			{
-				Process[i].last_state = READY;
-				Process[i].request_arg = 0;
-			}
-		}
+		p->prev = NULL;
+		p->next = q->head;
+		q->head = p;
 	}
-	Tick_Count = 0;
+	else
+	{
+		p->prev = before;
+		p->next = before->next;
+		before->next = p;
+	}
+	
+	if(p->next == NULL)
+		q->tail = p;
+	else
+		p->next->prev = p;
 }
 
-/************************************************************************/
-/*                   TASK RELATED KERNEL FUNCTIONS                      */
-/************************************************************************/
+#ifdef EDF_SCHEDULING
+/*Returns non-zero if task a has to run before task b. Tasks that aren't periodic have no deadline, so they come after the periodic ones.*/
+static unsigned char Earlier_Deadline(PD *a, PD *b)
+{
+	if(a->period == 0)
+		return 0;
+	if(b->period == 0)
+		return 1;
+	
+	//Deadlines are compared through their difference, so they may wrap around
+	return (int)(a->deadline - b->deadline) < 0;
+}
 
-/* Handles all low level operations for creating a new task */
-void Kernel_Create_Task(voidfuncptr f, PRIORITY py, int arg)
+/*Inserts a task into a ready queue kept in deadline order, behind the tasks with the same or an earlier deadline*/
+static void Queue_Insert_Deadline(volatile PD_QUEUE *q, PD *p)
 {
-	int x;
-	unsigned char *sp;
-	PD *p;
+	PD *before = q->tail;
+	
+	while(before != NULL && Earlier_Deadline(p, before))
+		before = before->prev;
+	
+	if(before == NULL)
+	{
+		p->prev = NULL;
+		p->next = q->head;
+		q->head = p;
+	}
+	else
+	{
+		p->prev = before;
+		p->next = before->next;
+		before->next = p;
+	}
+	
+	if(p->next == NULL)
+		q->tail = p;
+	else
+		p->next->prev = p;
+}
+#endif
 
-	#ifdef OS_DEBUG
-	int counter = 0;
+/*Marks a task as READY and places it at the back of the ready queue for its priority with a fresh time slice. With EDF, its place depends on its deadline instead.*/
+static void Enqueue_Ready(PD *p)
+{
+	if(p->state != RUNNING && p->state != READY)
+		Trace(TRACE_WAKE, TRACE_TASK(p), p->state);
+	
+	p->state = READY;
+	p->slice = Time_Slice[p->pri];
+	#ifdef EDF_SCHEDULING
+	Queue_Insert_Deadline(&Ready_Queue[p->pri], p);
+	#else
+	Queue_Append(&Ready_Queue[p->pri], p);
 	#endif
+	Ready_Bitmap |= (1 << p->pri);
+}
+
+/*Takes a task out of the sleep queue before its wake-up time, handing its remaining delta on to the task behind it*/
+static void Sleep_Remove(PD *p)
+{
+	PD *prev = NULL;
+	PD *cur = (PD*)Sleep_Queue;
 	
-	//Make sure the system can still have enough resources to create more tasks
-	if (Task_Count == MAXTHREAD)
+	while(cur != p)
 	{
-		#ifdef OS_DEBUG
-		printf("Task_Create: Failed to create task. The system is at its process threshold.\n");
-		#endif
-		
-		err = MAX_PROCESS_ERR;
-		return;
+		prev = cur;
+		cur = cur->sleep_next;
 	}
-
-	//Find a dead or empty PD slot to allocate our new task
-	for (x = 0; x < MAXTHREAD; x++)
-	if (Process[x].state == DEAD) break;
 	
-	++Task_Count;
-	p = &(Process[x]);
+	if(p->sleep_next != NULL)
+		p->sleep_next->wake_delta += p->wake_delta;
 	
-	/*The code below was agglomerated from Kernel_Create_Task_At;*/
+	if(prev == NULL)
+		Sleep_Queue = p->sleep_next;
+	else
+		prev->sleep_next = p->sleep_next;
 	
-	//Initializing the workspace memory for the new task
-	sp = (unsigned char *) &(p->workSpace[WORKSPACE-1]);
-	memset(&(p->workSpace),0,WORKSPACE);
-
-	//Store terminate at the bottom of stack to protect against stack underrun.
-	*(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
-	*(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
-	*(unsigned char *)sp-- = 0x00;
+	p->sleep_next = NULL;
+	p->wake_delta = 0;
+	p->timed = 0;
+}
 
-	//Place return address of function at bottom of stack
-	*(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
-	*(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
-	*(unsigned char *)sp-- = 0x00;
+/*Makes a task that was waiting READY again, cancelling the timeout of its wait (if any). A task that was suspended meanwhile will be back into its READY state when task_resume is called again.*/
+static void Wake_Task(PD *p)
+{
+	if(p->timed)
+		Sleep_Remove(p);
+	
+	if(p->state == SUSPENDED)
+		p->last_state = READY;
+	else
+		Enqueue_Ready(p);
+}
 
-	//Allocate the stack with enough memory spaces to save the registers needed for ctxswitch
-	#ifdef OS_DEBUG
-	 //Fill stack with initial values for development debugging
-	 for (counter = 0; counter < 34; counter++)
-	 {
-		 *(unsigned char *)sp-- = counter;
-	 }
+/*Places a preempted task back at the front of its ready queue, so it gets to finish the rest of its time slice first*/
+static void Enqueue_Ready_Front(PD *p)
+{
+	volatile PD_QUEUE *q = &Ready_Queue[p->pri];
+	
+	p->state = READY;
+	#ifdef EDF_SCHEDULING
+	//A task with a nearer deadline may be waiting in the same queue, e.g. one woken together with the task that preempted us
+	Queue_Insert_Deadline(q, p);
 	#else
-	 //Place stack pointer at top of stack
-	 sp = sp - 34;
+	p->prev = NULL;
+	p->next = q->head;
+	
+	if(q->head == NULL)
+		q->tail = p;
+	else
+		q->head->prev = p;
+	q->head = p;
 	#endif
+	Ready_Bitmap |= (1 << p->pri);
+}
+
+/*Takes a READY task out of its ready queue. The caller is responsible for setting its new state.*/
+static void Dequeue_Ready(PD *p)
+{
+	Queue_Remove(&Ready_Queue[p->pri], p);
+	if(Ready_Queue[p->pri].head == NULL)
+		Ready_Bitmap &= ~(1 << p->pri);
+}
+
+/*Returns the highest priority that currently has a READY task. Only valid if Ready_Bitmap is not 0.*/
+static PRIORITY Highest_Ready_Priority()
+{
+	unsigned int map = Ready_Bitmap;
 	
-	//Build the process descriptor for the new task
-	p->pid = ++Last_PID;
-	p->pri = py;
-	p->arg = arg;
-	p->request = NONE;
-	p->state = READY;
-	p->sp = sp;					/* stack pointer into the "workSpace" */
-	p->code = f;				/* function to be executed as a task */
+	if(map & 0x00FF)
+	{
+		if(map & 0x000F)
+			return Lowest_Bit[map & 0x0F];
+		return 4 + Lowest_Bit[(map >> 4) & 0x0F];
+	}
 	
-	//No errors occured
-	err = NO_ERR;
+	if(map & 0x0F00)
+		return 8 + Lowest_Bit[(map >> 8) & 0x0F];
+	return 12 + Lowest_Bit[(map >> 12) & 0x0F];
 }
 
-/*TODO: Check for mutex ownership. If PID owns any mutex, ignore this request*/
-static void Kernel_Suspend_Task() 
+/*Returns the priority ordered queue a blocked (or blocked and then suspended) task waits in, or NULL if it isn't in one*/
+static volatile PD_QUEUE* Wait_Queue(PD *p)
 {
-	//Finds the process descriptor for the specified PID
-	PD* p = findProcessByPID(Cp->request_arg);
+	PROCESS_STATES state = (p->state == SUSPENDED) ? p->last_state : p->state;
 	
-	//Ensure the PID specified in the PD currently exists in the global process list
-	if(p == NULL)
+	switch(state)
 	{
-		#ifdef OS_DEBUG
-			printf("Kernel_Suspend_Task: PID not found in global process list!\n");
-		#endif
-		err = PID_NOT_FOUND_ERR;
+		case WAIT_MUTEX:
+		return &p->blocked_on->waiters;
+		
+		case WAIT_SEM:
+		return &findSemBySemID(p->request_arg)->waiters;
+		
+		case WAIT_SEND:
+		return &findMsgQByMsgQID(p->request_arg)->senders;
+		
+		case WAIT_RECEIVE:
+		return &findMsgQByMsgQID(p->request_arg)->receivers;
+		
+		case WAIT_BUFFER:
+		return &Msg_Waiters;
+		
+		case WAIT_FLAGS:
+		return &findFlagsByFlagsID(p->request_arg)->waiters;
+		
+		default:
+		return NULL;
+	}
+}
+
+/*Changes the priority of a task, moving it to its new place in its ready queue or wait queue*/
+static void Kernel_Set_Priority(PD *p, PRIORITY pri)
+{
+	volatile PD_QUEUE *q;
+	
+	if(p->pri == pri)
 		return;
+	
+	if(p->state == READY)
+	{
+		Dequeue_Ready(p);
+		p->pri = pri;
+		Enqueue_Ready(p);
+	}
+	else if((q = Wait_Queue(p)) != NULL)
+	{
+		Queue_Remove(q, p);
+		p->pri = pri;
+		Queue_Insert_Priority(q, p);
 	}
+	else
+		p->pri = pri;
+}
+
+/************************************************************************/
+/*						  STACK POOL HELPERS                            */
+/************************************************************************/
+
+/*
+ * Takes a stack of *size bytes out of the stack pool (first fit). Returns its lowest address, or NULL if no free block is large enough.
+ * If the whole block is handed out, *size is raised to the block's size, so Stack_Free later gets all of it back.
+ */
+static unsigned char* Stack_Alloc(unsigned int *size)
+{
+	STACK_BLOCK *b = Free_Stacks;
+	STACK_BLOCK *prev = NULL;
 	
-	//Ensure the task is not in a unsuspendable state
-	if(p->state == DEAD || p->state == SUSPENDED)
+	while(b != NULL && b->size < *size)
 	{
-		#ifdef OS_DEBUG
-		printf("Kernel_Suspend_Task: Trying to suspend a task that's in an unsuspendable state %d!\n", p->state);
-		#endif
-		err = SUSPEND_NONRUNNING_TASK_ERR;
-		return;
+		prev = b;
+		b = b->next;
 	}
 	
-	//Ensure the task is not currently owning a mutex
-	for(int i=0; i<MAXMUTEX; i++) {
-		if (Mutex[i].owner == p->pid) {
-			#ifdef OS_DEBUG
-			printf("Kernel_Suspend_Task: Trying to suspend a task that currently owns a mutex\n");
-			#endif
-			err = SUSPEND_NONRUNNING_TASK_ERR;
-			return;
-		}
+	if(b == NULL)
+		return NULL;
+	
+	//Carve the stack from the end of the block if the rest is still usable as a free block, otherwise hand out the whole block
+	if(b->size - *size >= sizeof(STACK_BLOCK))
+	{
+		b->size -= *size;
+		return (unsigned char*)b + b->size;
 	}
 	
-	//Save its current state and set it to SUSPENDED
-	p->last_state = p->state;
-	p->state = SUSPENDED;
-	err = NO_ERR;
+	*size = b->size;
+	if(prev == NULL)
+		Free_Stacks = b->next;
+	else
+		prev->next = b->next;
+	return (unsigned char*)b;
 }
 
-static void Kernel_Resume_Task()
+/*Returns a stack to the stack pool, merging it with the free blocks right next to it*/
+static void Stack_Free(unsigned char *stack, unsigned int size)
 {
-	//Finds the process descriptor for the specified PID
-	PD* p = findProcessByPID(Cp->request_arg);
+	STACK_BLOCK *b = (STACK_BLOCK*)stack;
+	STACK_BLOCK *prev = NULL;
+	STACK_BLOCK *next = Free_Stacks;
 	
-	//Ensure the PID specified in the PD currently exists in the global process list
-	if(p == NULL)
+	//Find where the block goes in the address ordered free list
+	while(next != NULL && (unsigned char*)next < stack)
 	{
-		#ifdef OS_DEBUG
-			printf("Kernel_Resume_Task: PID not found in global process list!\n");
-		#endif
-		err = PID_NOT_FOUND_ERR;
-		return;
+		prev = next;
+		next = next->next;
 	}
 	
-	//Ensure the task is currently in the SUSPENDED state
-	if(p->state != SUSPENDED)
+	b->size = size;
+	b->next = next;
+	
+	//Merge with the following block
+	if(next != NULL && stack + size == (unsigned char*)next)
 	{
-		#ifdef OS_DEBUG
-		printf("Kernel_Resume_Task: Trying to resume a task that's not SUSPENDED!\n");
-		printf("CURRENT STATE: %d\n", p->state);
-		#endif
-		err = RESUME_NONSUSPENDED_TASK_ERR;
-		return;
+		b->size += next->size;
+		b->next = next->next;
 	}
 	
-	//Restore the previous state of the task
-	p->state = p->last_state;
-	p->last_state = SUSPENDED;			
-	err = NO_ERR;
+	//Merge with the preceding block
+	if(prev != NULL && (unsigned char*)prev + prev->size == stack)
+	{
+		prev->size += b->size;
+		prev->next = b->next;
+	}
+	else if(prev != NULL)
+		prev->next = b;
+	else
+		Free_Stacks = b;
 }
 
 /************************************************************************/
-/*                  EVENT RELATED KERNEL FUNCTIONS                      */
+/*						   KERNEL STATISTICS                            */
 /************************************************************************/
 
-void Kernel_Create_Event(void)
+#ifdef OS_STATS
+
+#define STATS_COUNT(counter) (++Stats.counter)
+
+/*Returns the Timer1 counts since the last call and restarts the measurement. Interrupts are off in the kernel, so at most one tick boundary can lie in between.*/
+static unsigned int Stats_Lap()
 {
-	int i;
+	unsigned int now = TCNT1;
+	unsigned int elapsed;
 	
-	//Make sure the system's events are not at max
+	if(now >= Stats_Stamp)
+		elapsed = now - Stats_Stamp;
+	else
+		elapsed = now + TICK_LENG - Stats_Stamp;
+	
+	Stats_Stamp = now;
+	return elapsed;
+}
+
+/*Starts timing a request on entry to the kernel*/
+static void Stats_Begin()
+{
+	Stats_Stamp = TCNT1;
+	Stats_Elapsed = 0;
+}
+
+/*Stops the clock while the kernel is idle, so time spent waiting for a ready task isn't charged to the request*/
+static void Stats_Pause()
+{
+	Stats_Elapsed += Stats_Lap();
+}
+
+static void Stats_Resume()
+{
+	Stats_Stamp = TCNT1;
+}
+
+/*Records the time taken by a request once the kernel is done with it*/
+static void Stats_End(KERNEL_REQUEST_TYPE request)
+{
+	volatile REQUEST_STATS *r = &Stats.request[request];
+	unsigned int elapsed = Stats_Elapsed + Stats_Lap();
+	unsigned int n = elapsed;
+	unsigned char bucket;
+	
+	//The bucket is the number of significant bits of the elapsed time
+	for(bucket = 0; n > 0 && bucket < STATS_BUCKETS - 1; bucket++)
+		n >>= 1;
+	
+	if(r->count == 0 || elapsed < r->min)
+		r->min = elapsed;
+	if(elapsed > r->max)
+		r->max = elapsed;
+	++r->count;
+	++r->histogram[bucket];
+}
+
+/*Copies the kernel statistics into stats. Interrupts are only held off for one small piece at a time, so reading them doesn't delay the schedule.*/
+void getKernelStats(KERNEL_STATS *stats)
+{
+	unsigned char sreg;
+	int i;
+	
+	for(i = 0; i < NUM_REQUEST_TYPES; i++)
+	{
+		sreg = SREG;
+		Disable_Interrupt();
+		stats->request[i] = *(REQUEST_STATS*)&Stats.request[i];
+		SREG = sreg;
+	}
+	
+	sreg = SREG;
+	Disable_Interrupt();
+	stats->dispatches = Stats.dispatches;
+	stats->context_switches = Stats.context_switches;
+	stats->idle_loops = Stats.idle_loops;
+	stats->late_tick_isrs = Stats.late_tick_isrs;
+	SREG = sreg;
+}
+
+/*Clears all kernel statistics, e.g. to start a new measurement*/
+void resetKernelStats()
+{
+	unsigned char sreg;
+	int i;
+	
+	for(i = 0; i < NUM_REQUEST_TYPES; i++)
+	{
+		sreg = SREG;
+		Disable_Interrupt();
+		memset((void*)&Stats.request[i], 0, sizeof(REQUEST_STATS));
+		SREG = sreg;
+	}
+	
+	sreg = SREG;
+	Disable_Interrupt();
+	Stats.dispatches = 0;
+	Stats.context_switches = 0;
+	Stats.idle_loops = 0;
+	Stats.late_tick_isrs = 0;
+	SREG = sreg;
+}
+
+#else
+
+#define STATS_COUNT(counter)
+#define Stats_Begin()
+#define Stats_Pause()
+#define Stats_Resume()
+#define Stats_End(request)
+
+#endif
+
+/************************************************************************/
+/*				   		       OS HELPERS                               */
+/************************************************************************/
+
+/*Returns the PID associated with a function's memory address. Unlike handle lookups, this still has to search the process list.*/
+PID findPIDByFuncPtr(voidfuncptr f)
+{
+	int i;
+	
+	for(i=0; i<MAXTHREAD; i++)
+	{
+		if (Process[i].code == f && Process[i].state != DEAD)
+			return Process[i].pid;
+	}
+	
+	//No process with such PID. Note that a valid PID is never 0.
+	return 0;
+}
+
+/*Only useful if our RTOS allows more than one missed event signals to be recorded*/
+int getEventCount(EVENT e)
+{
+	EVENT_TYPE* e1 = findEventByEventID(e);
+	
+	if(e1 == NULL) 
+		return 0;
+		
+	return e1->count;	
+}
+
+/*Returns the most bytes of its stack a task has used so far (found from the untouched paint above the canary), 0 if the PID is invalid*/
+unsigned int getStackHighWater(PID pid)
+{
+	PD *p = findProcessByPID(pid);
+	unsigned int i;
+	
+	if(p == NULL)
+		return 0;
+	
+	//The stack grows downwards, so the painted bytes left at its low end were never used
+	for(i = STACK_CANARY_SIZE; i < p->stack_size && p->stack[i] == STACK_PAINT; i++);
+	
+	return p->stack_size - i;
+}
+
+/*Returns 0 if a task has overflowed its stack: either its canary was overwritten, or there's no room left to save its context*/
+static unsigned char Stack_Intact(PD *p)
+{
+	unsigned int i;
+	
+	for(i = 0; i < STACK_CANARY_SIZE; i++)
+		if(p->stack[i] != STACK_CANARY)
+			return 0;
+	
+	return CurrentSp > p->stack + STACK_CANARY_SIZE + LIGHT_FRAME_REGS;
+}
+
+/************************************************************************/
+/*                      CPU TIME ACCOUNTING                             */
+/************************************************************************/
+
+#define WINDOW_LENG ((unsigned long)UTIL_WINDOW * TICK_LENG)	//Length of a utilisation window in Timer1 counts
+
+/*Returns the ticks since OS_Start(), and the position of Timer1 in the current one through count. Interrupts must be disabled.*/
+static unsigned long Kernel_Clock(unsigned int *count)
+{
+	unsigned long ticks = Elapsed_Ticks + Tick_Count;
+	
+	*count = TCNT1;
+	
+	//Timer1 has restarted, but its interrupt hasn't been serviced yet. Read it again in case it restarted after the first read.
+	if(TIFR1 & (1<<OCF1A))
+	{
+		*count = TCNT1;
+		ticks += Tick_Period;
+	}
+	
+	return ticks;
+}
+
+/*Returns the time since OS_Start() in Timer1 counts (16us each), from the ticks so far and the position of Timer1 in the current one. Interrupts must be disabled.*/
+static unsigned long Kernel_Now()
+{
+	unsigned int count;
+	unsigned long ticks = Kernel_Clock(&count);
+	
+	return ticks * TICK_LENG + count;
+}
+
+/*Charges the CPU time since the last call to whoever had the CPU: the idle kernel, or Cp*/
+static void Account_Time()
+{
+	unsigned long now = Kernel_Now();
+	
+	if(Kernel_Idle)
+		Idle_Time += now - Run_Start;
+	else if(Cp != NULL)
+		Cp->run_time += now - Run_Start;
+	Run_Start = now;
+}
+
+/*Starts a new utilisation window once the current one is over, keeping what every task used during the one that ended*/
+static void Account_Window()
+{
+	int x;
+	
+	if(Kernel_Now() - Window_Start < WINDOW_LENG)
+		return;
+	
+	Account_Time();
+	for(x = 0; x < MAXTHREAD; x++)
+	{
+		Process[x].last_window = Process[x].run_time - Process[x].window_mark;
+		Process[x].window_mark = Process[x].run_time;
+	}
+	Idle_Last_Window = Idle_Time - Idle_Window_Mark;
+	Idle_Window_Mark = Idle_Time;
+	
+	//If the kernel wasn't entered for more than a window, start the next one now
+	Window_Start += WINDOW_LENG;
+	if(Run_Start - Window_Start >= WINDOW_LENG)
+		Window_Start = Run_Start;
+}
+
+/*
+ * Returns the percentage of the last UTIL_WINDOW ticks spent by a task (or by the idle kernel).
+ * The window slides with every call: it takes the time used in the current window, plus the part of the previous window
+ * that still falls inside it, assuming the previous window's time was spread evenly over it.
+ */
+static unsigned char Utilisation(unsigned long used, unsigned long mark, unsigned long last)
+{
+	unsigned long into_window = Kernel_Now() - Window_Start;
+	unsigned long estimate;
+	
+	if(into_window > WINDOW_LENG)
+		into_window = WINDOW_LENG;
+	
+	estimate = last * (WINDOW_LENG - into_window) / WINDOW_LENG + (used - mark);
+	if(estimate > WINDOW_LENG)
+		estimate = WINDOW_LENG;
+	
+	return estimate * 100 / WINDOW_LENG;
+}
+
+/*Returns the total time a task has spent on the CPU in Timer1 counts (16us each), 0 if the PID is invalid*/
+unsigned long getTaskRunTime(PID pid)
+{
+	PD *p;
+	unsigned long run_time = 0;
+	unsigned char sreg = SREG;
+	
+	Disable_Interrupt();
+	p = findProcessByPID(pid);
+	if(p != NULL)
+	{
+		if(KernelActive)
+			Account_Time();
+		run_time = p->run_time;
+	}
+	SREG = sreg;
+	
+	return run_time;
+}
+
+/*Returns the percentage of the CPU a task has used over the last UTIL_WINDOW ticks, 0 if the PID is invalid*/
+unsigned char getTaskUtilisation(PID pid)
+{
+	PD *p;
+	unsigned char percent = 0;
+	unsigned char sreg = SREG;
+	
+	Disable_Interrupt();
+	p = findProcessByPID(pid);
+	if(p != NULL && KernelActive)
+	{
+		Account_Time();
+		percent = Utilisation(p->run_time, p->window_mark, p->last_window);
+	}
+	SREG = sreg;
+	
+	return percent;
+}
+
+/*Returns the percentage of the last UTIL_WINDOW ticks the kernel has spent idle*/
+unsigned char getIdleUtilisation()
+{
+	unsigned char percent = 0;
+	unsigned char sreg = SREG;
+	
+	Disable_Interrupt();
+	if(KernelActive)
+	{
+		Account_Time();
+		percent = Utilisation(Idle_Time, Idle_Window_Mark, Idle_Last_Window);
+	}
+	SREG = sreg;
+	
+	return percent;
+}
+
+/************************************************************************/
+/*                      DEADLINE MONITORING                             */
+/************************************************************************/
+
+/*Returns the time since the start of a past tick in Timer1 counts. The tick has to lie less than half the range of TICK back.*/
+static unsigned long Time_Since_Tick(TICK tick)
+{
+	unsigned int count;
+	TICK ticks = Kernel_Clock(&count);
+	
+	return (unsigned long)(TICK)(ticks - tick) * TICK_LENG + count;
+}
+
+/*Records how late the current job of a periodic task has started, when it's dispatched for the first time since its release*/
+static void Job_Start(PD *p)
+{
+	unsigned long jitter = Time_Since_Tick(p->release);
+	unsigned long n = jitter >> JITTER_SHIFT;
+	unsigned char bucket;
+	
+	//The bucket is the number of significant bits of the scaled jitter, like the request latency histograms
+	for(bucket = 0; n > 0 && bucket < JITTER_BUCKETS - 1; bucket++)
+		n >>= 1;
+	
+	if(jitter > p->timing.worst_jitter)
+		p->timing.worst_jitter = jitter;
+	++p->timing.jitter[bucket];
+	p->job_flags |= JOB_STARTED;
+}
+
+/*Links the current job of a periodic task into the deadline queue, behind the jobs due no later than it*/
+static void Deadline_Insert(PD *p)
+{
+	PD *prev = NULL;
+	PD *cur = (PD*)Deadline_Queue;
+	
+	while(cur != NULL && (int)(cur->deadline - p->deadline) <= 0)
+	{
+		prev = cur;
+		cur = cur->deadline_next;
+	}
+	
+	p->deadline_next = cur;
+	if(prev == NULL)
+		Deadline_Queue = p;
+	else
+		prev->deadline_next = p;
+}
+
+/*Takes a task out of the deadline queue*/
+static void Deadline_Remove(PD *p)
+{
+	PD *prev = NULL;
+	PD *cur = (PD*)Deadline_Queue;
+	
+	while(cur != NULL && cur != p)
+	{
+		prev = cur;
+		cur = cur->deadline_next;
+	}
+	
+	if(cur == NULL)
+		return;
+	if(prev == NULL)
+		Deadline_Queue = p->deadline_next;
+	else
+		prev->deadline_next = p->deadline_next;
+	p->deadline_next = NULL;
+}
+
+/*Finishes the current job of a periodic task, recording how late it was if it has missed its deadline. A job that hasn't is taken out of the deadline queue.*/
+static void Job_Done(PD *p)
+{
+	unsigned long lateness;
+	
+	++p->timing.jobs;
+	if(p->job_flags & JOB_MISSED)
+	{
+		lateness = Time_Since_Tick(p->deadline);
+		if(lateness > p->timing.worst_lateness)
+			p->timing.worst_lateness = lateness;
+	}
+	else
+		Deadline_Remove(p);
+	p->job_flags = 0;
+}
+
+/*
+ * Counts a miss for every job at the front of the deadline queue whose deadline has come, and takes it out of the queue.
+ * The tick ISR traps into the kernel on that tick, and the idle kernel doesn't sleep past it, so a miss is noticed
+ * on the first tick the kernel can handle at or after the deadline, even if the job never finishes.
+ */
+static void Check_Deadlines()
+{
+	PD *p;
+	
+	while(Deadline_Queue != NULL && (int)((TICK)Elapsed_Ticks - Deadline_Queue->deadline) >= 0)
+	{
+		p = (PD*)Deadline_Queue;
+		Deadline_Queue = p->deadline_next;
+		p->deadline_next = NULL;
+		
+		p->job_flags |= JOB_MISSED;
+		++p->timing.misses;
+		if(Miss_Handler != NULL)
+			Miss_Handler(p->pid);
+	}
+}
+
+/*Copies the deadline statistics of a periodic task into stats. Returns 0 if the PID is invalid.*/
+unsigned char getDeadlineStats(PID pid, DEADLINE_STATS *stats)
+{
+	unsigned char sreg = SREG;
+	PD *p;
+	
+	Disable_Interrupt();
+	p = findProcessByPID(pid);
+	if(p != NULL)
+		*stats = p->timing;
+	SREG = sreg;
+	
+	return p != NULL;
+}
+
+/*Clears the deadline statistics of a task, e.g. to start a new measurement*/
+void resetDeadlineStats(PID pid)
+{
+	unsigned char sreg = SREG;
+	PD *p;
+	
+	Disable_Interrupt();
+	p = findProcessByPID(pid);
+	if(p != NULL)
+		memset(&p->timing, 0, sizeof(DEADLINE_STATS));
+	SREG = sreg;
+}
+
+/*Sets the function called by the kernel whenever a periodic job misses its deadline, NULL for none*/
+void setDeadlineMissHandler(missfuncptr f)
+{
+	unsigned char sreg = SREG;
+	
+	Disable_Interrupt();
+	Miss_Handler = f;
+	SREG = sreg;
+}
+
+/************************************************************************/
+/*                  ISR FOR HANDLING SLEEP TICKS                        */
+/************************************************************************/
+
+/*
+  * Called from the timer tick ISR (TIMER1_COMPA_vect, named __vector_17 in cswitch.s) after the interrupted context has been saved.
+  * Returns non-zero if the running task has to trap into the kernel, in which case its request is set to PREEMPT.
+  */
+unsigned char Kernel_Tick_ISR()
+{
+	Trace(TRACE_TICK, Kernel_Idle ? TRACE_NO_TASK : TRACE_TASK(Cp), Tick_Period);
+	Tick_Count += Tick_Period;
+	Tick_Period = 1;
+	
+	//Timer1 restarted from 0 on the compare match, so TCNT1 tells how long this interrupt was held off
+	if(TCNT1 >= TICK_LENG / 2)
+		STATS_COUNT(late_tick_isrs);
+	
+	//The kernel is waiting for a ready task and will process the tick by itself
+	if(Kernel_Idle)
+		return 0;
+	
+	if(Cp->slice > 0)
+		--Cp->slice;
+	
+	//Only trap into the kernel if a sleeping task is due, a periodic job has reached its deadline, an interrupt handler left a request, 
+	//or the time slice has ended while another task of the same or higher priority is waiting
+	if((Sleep_Queue != NULL && Sleep_Queue->wake_delta <= Tick_Count) || 
+	   (Deadline_Queue != NULL && (int)((TICK)(Elapsed_Ticks + Tick_Count) - Deadline_Queue->deadline) >= 0) ||
+	   ISR_Queue_Head != ISR_Queue_Tail ||
+	   (Cp->slice == 0 && (Ready_Bitmap & ((2 << Cp->pri) - 1))))
+	{
+		Cp->request = PREEMPT;
+		return 1;
+	}
+	
+	return 0;
+}
+
+/*Stretches the current Timer1 period to cover n ticks, so the idle kernel isn't woken up by ticks nobody is waiting for*/
+static void Timer_Skip_Ticks(TICK n)
+{
+	//A tick that came in while the kernel was busy has to be counted normally first
+	if(n <= 1 || (TIFR1 & (1<<OCF1A)))
+		return;
+	
+	if(n > MAX_IDLE_TICKS)
+		n = MAX_IDLE_TICKS;
+	
+	//TCNT1 is still inside the current tick, so the compare match now happens on the n-th tick boundary
+	OCR1A = n * TICK_LENG - 1;
+	
+	//The tick may have ended between the check above and the write. Timer1 has then restarted, and only one tick has passed when its interrupt is serviced.
+	if(TIFR1 & (1<<OCF1A))
+	{
+		OCR1A = TICK_LENG - 1;
+		return;
+	}
+	Tick_Period = n;
+}
+
+/*Returns how many ticks the idle kernel may sleep: until the next sleeping task is due or the nearest deadline of an unfinished job comes*/
+static TICK Idle_Wake_Ticks()
+{
+	TICK n = (Sleep_Queue != NULL) ? Sleep_Queue->wake_delta : MAX_IDLE_TICKS;
+	TICK d;
+	
+	//Deadlines that have come were taken out of the queue by the tick handler, so d is at least 1
+	if(Deadline_Queue != NULL)
+	{
+		d = Deadline_Queue->deadline - (TICK)Elapsed_Ticks;
+		if(d < n)
+			n = d;
+	}
+	
+	return n;
+}
+
+/*Returns Timer1 to one tick per period after the idle kernel was woken up, counting the whole ticks that passed if it was woken early*/
+static void Timer_Resume_Ticks()
+{
+	unsigned int elapsed;
+	unsigned int count;
+	
+	if(Tick_Period > 1)
+	{
+		//The division is done while Timer1 runs, so it's only stopped for the few cycles it takes to set it back into the current tick
+		elapsed = TCNT1 / TICK_LENG;
+		TCCR1B &= ~(1<<CS12);
+		
+		//The stretched period has just ended, but its interrupt hasn't been serviced. Timer1 has restarted from 0 since.
+		if(TIFR1 & (1<<OCF1A))
+		{
+			TIFR1 = (1<<OCF1A);
+			Tick_Count += Tick_Period;
+			Trace(TRACE_TICK, TRACE_NO_TASK, Tick_Period);
+			elapsed = 0;
+		}
+		
+		//Count the finished ticks and keep the time already spent in the current one. A tick may have ended since TCNT1 was divided.
+		count = TCNT1 - elapsed * TICK_LENG;
+		if(count >= TICK_LENG)
+		{
+			count -= TICK_LENG;
+			++elapsed;
+		}
+		TCNT1 = count;
+		OCR1A = TICK_LENG - 1;
+		TCCR1B |= (1<<CS12);
+		
+		Tick_Count += elapsed;
+		Tick_Period = 1;
+		if(elapsed > 0)
+			Trace(TRACE_TICK, TRACE_NO_TASK, elapsed);
+	}
+	else
+		OCR1A = TICK_LENG - 1;
+}
+
+/*Links a task into the sleep queue to be woken up in t ticks. Only the tasks it's placed in front of have their wake time adjusted.*/
+static void Sleep_Insert(PD *p, TICK t)
+{
+	PD *prev = NULL;
+	PD *cur = (PD*)Sleep_Queue;
+	
+	//Skip past every task that wakes up no later than this one, making t relative to the last one skipped
+	while(cur != NULL && cur->wake_delta <= t)
+	{
+		t -= cur->wake_delta;
+		prev = cur;
+		cur = cur->sleep_next;
+	}
+	
+	//Link the task in, and make the task behind it relative to the new task's wake-up instead
+	p->wake_delta = t;
+	p->sleep_next = cur;
+	if(cur != NULL)
+		cur->wake_delta -= t;
+	
+	if(prev == NULL)
+		Sleep_Queue = p;
+	else
+		prev->sleep_next = p;
+}
+
+/*Puts a task to sleep for t ticks*/
+static void Kernel_Sleep_Task(PD *p, TICK t)
+{
+	Sleep_Insert(p, t);
+	p->state = SLEEPING;
+}
+
+/*Puts a task to sleep until the tick count reaches when. It keeps running if that time has already come, e.g. because it overran its period.*/
+static void Kernel_Sleep_Until(PD *p, TICK when)
+{
+	//The sleep queue is relative to the ticks processed so far, and the difference is taken modulo the wrap-around of TICK
+	TICK t = when - (TICK)Elapsed_Ticks;
+	
+	if(t == 0 || (int)t < 0)
+		return;
+	Kernel_Sleep_Task(p, t);
+}
+
+/*Returns the number of ticks since OS_Start(), wrapping around like TICK does. Includes the ticks the kernel hasn't processed yet.*/
+TICK getTicks()
+{
+	TICK ticks;
+	unsigned char sreg = SREG;
+	
+	Disable_Interrupt();
+	ticks = Elapsed_Ticks + Tick_Count;
+	SREG = sreg;
+	
+	return ticks;
+}
+
+static void Kernel_Cancel_Wait(PD *p);
+
+
+//Applies the ticks that came in since the last call to the sleep queue. Only the tasks whose sleep expired are touched, and they are placed back into their old state
+void Kernel_Tick_Handler()
+{
+	unsigned int ticks;
+	PD *p;
+	
+	//No ticks has been issued yet, skipping...
+	if(Tick_Count == 0)
+		return;
+	
+	ticks = Tick_Count;
+	Tick_Count = 0;
+	Elapsed_Ticks += ticks;
+	Account_Window();
+	Check_Deadlines();
+	
+	//Wake every task at the front of the queue whose remaining delta has been covered by the elapsed ticks
+	while(Sleep_Queue != NULL && Sleep_Queue->wake_delta <= ticks)
+	{
+		p = (PD*)Sleep_Queue;
+		ticks -= p->wake_delta;
+		Sleep_Queue = p->sleep_next;
+		p->sleep_next = NULL;
+		p->wake_delta = 0;
+		
+		//A task that isn't simply sleeping has waited for something as long as it may
+		if(p->timed)
+		{
+			p->timed = 0;
+			Kernel_Cancel_Wait(p);
+		}
+		Wake_Task(p);
+	}
+	
+	//Every remaining sleeper is relative to the first one, so only it needs updating
+	if(Sleep_Queue != NULL)
+		Sleep_Queue->wake_delta -= ticks;
+}
+
+/************************************************************************/
+/*                   TASK RELATED KERNEL FUNCTIONS                      */
+/************************************************************************/
+
+/* Handles all low level operations for creating a new task */
+PID Kernel_Create_Task(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size)
+{
+	int x;
+	unsigned char *sp;
+	PD *p;
+
+	#ifdef OS_DEBUG
+	int counter = 0;
+	#endif
+	
+	//Make sure the system can still have enough resources to create more tasks
+	if (Task_Count == MAXTHREAD)
+	{
+		#ifdef OS_DEBUG
+		printf("Task_Create: Failed to create task. The system is at its process threshold.\n");
+		#endif
+		
+		err = MAX_PROCESS_ERR;
+		return 0;
+	}
+	
+	if (py > LOWEST_PRIORITY)
+	{
+		#ifdef OS_DEBUG
+		printf("Task_Create: Failed to create task. Invalid priority %d.\n", py);
+		#endif
+		
+		err = INVALID_ARG_ERR;
+		return 0;
+	}
+	
+	//Use the default stack size if none is given, and never less than what a task needs to be switched out
+	if (stack_size == 0)
+		stack_size = WORKSPACE;
+	else if (stack_size < MIN_STACK_SIZE)
+		stack_size = MIN_STACK_SIZE;
+	
+	//Dead tasks keep their stack until now, since one that was terminated on a tick still had its context pushed on it. Give them back to the pool.
+	for (x = 0; x < MAXTHREAD; x++)
+	{
+		if (Process[x].state == DEAD && Process[x].stack != NULL)
+		{
+			Stack_Free(Process[x].stack, Process[x].stack_size);
+			Process[x].stack = NULL;
+		}
+	}
+
+	//Find a dead or empty PD slot to allocate our new task
+	for (x = 0; x < MAXTHREAD; x++)
+	if (Process[x].state == DEAD) break;
+	
+	p = (PD*)&(Process[x]);
+	
+	p->stack = Stack_Alloc(&stack_size);
+	if (p->stack == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Task_Create: Failed to create task. Not enough room left in the stack pool for %u bytes.\n", stack_size);
+		#endif
+		
+		err = OUT_OF_STACK_ERR;
+		return 0;
+	}
+	p->stack_size = stack_size;
+	p->run_time = 0;
+	p->window_mark = 0;
+	p->last_window = 0;
+	++Task_Count;
+	
+	/*The code below was agglomerated from Kernel_Create_Task_At;*/
+	
+	//Initializing the workspace memory for the new task. It's painted so the high-water mark can be found later, and the canary marks its limit.
+	sp = p->stack + stack_size - 1;
+	memset(p->stack, STACK_PAINT, stack_size);
+	memset(p->stack, STACK_CANARY, STACK_CANARY_SIZE);
+
+	//Store terminate at the bottom of stack to protect against stack underrun.
+	*(unsigned char *)sp-- = ((unsigned int)Task_Terminate) & 0xff;
+	*(unsigned char *)sp-- = (((unsigned int)Task_Terminate) >> 8) & 0xff;
+	*(unsigned char *)sp-- = 0x00;
+
+	//Place return address of function at bottom of stack
+	*(unsigned char *)sp-- = ((unsigned int)f) & 0xff;
+	*(unsigned char *)sp-- = (((unsigned int)f) >> 8) & 0xff;
+	*(unsigned char *)sp-- = 0x00;
+
+	//Allocate the stack with enough memory spaces to restore a light context frame, the same kind a voluntary syscall saves
+	#ifdef OS_DEBUG
+	 //Fill stack with initial values for development debugging
+	 for (counter = 0; counter < LIGHT_FRAME_REGS; counter++)
+	 {
+		 *(unsigned char *)sp-- = counter;
+	 }
+	#else
+	 //Clear the initial registers and place stack pointer at top of stack
+	 for (x = 0; x < LIGHT_FRAME_REGS; x++)
+	 {
+		 *(unsigned char *)sp-- = 0;
+	 }
+	#endif
+	
+	//The frame type sits on top of the frame
+	*(unsigned char *)sp-- = LIGHT_FRAME;
+	
+	//Build the process descriptor for the new task
+	x = p - (PD*)Process;
+	p->pid = Last_PID = New_Handle(&p->gen, x);
+	p->pri = py;
+	p->base_pri = py;
+	p->blocked_on = NULL;
+	p->owned = NULL;
+	p->period = 0;
+	p->arg = arg;
+	p->request = NONE;
+	p->sp = sp;					/* stack pointer into the "workSpace" */
+	p->code = f;				/* function to be executed as a task */
+	Enqueue_Ready(p);
+	
+	//No errors occured
+	err = NO_ERR;
+	return p->pid;
+}
+
+/*
+ * Creates a task whose first job is released right away, and then every period ticks. Each job should be done within
+ * deadline ticks of its release (0 = by the next release), and takes at most wcet ticks of CPU time.
+ * With EDF_SCHEDULING, the task is refused if the periodic tasks could no longer all meet their deadlines. The test adds up
+ * wcet/deadline of every periodic task, which must not exceed the whole CPU. Time taken by tasks at higher priority levels isn't counted.
+ */
+PID Kernel_Create_Periodic_Task(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size, TICK period, TICK deadline, TICK wcet)
+{
+	PD *p;
+	#ifdef EDF_SCHEDULING
+	unsigned long load;
+	#endif
+	
+	if(deadline == 0)
+		deadline = period;
+	
+	if(period == 0 || deadline > period || wcet == 0 || wcet > deadline)
+	{
+		#ifdef OS_DEBUG
+		printf("Task_Create_Periodic: Invalid timing, need 0 < wcet <= deadline <= period.\n");
+		#endif
+		
+		err = INVALID_ARG_ERR;
+		return 0;
+	}
+	
+	#ifdef EDF_SCHEDULING
+	//Rounded up, so the sum never claims more room than there really is
+	load = ((unsigned long)wcet * EDF_FULL_LOAD + deadline - 1) / deadline;
+	if(Edf_Load + load > EDF_FULL_LOAD)
+	{
+		#ifdef OS_DEBUG
+		printf("Task_Create_Periodic: Failed to create task. The periodic tasks would need more than the whole CPU.\n");
+		#endif
+		
+		err = ADMISSION_ERR;
+		return 0;
+	}
+	#endif
+	
+	if(Kernel_Create_Task(f, py, arg, stack_size) == 0)
+		return 0;
+	
+	//The task was queued as a non-periodic one, so it has to be queued again once it has a deadline
+	p = findProcessByPID(Last_PID);
+	Dequeue_Ready(p);
+	p->period = period;
+	p->rel_deadline = deadline;
+	p->wcet = wcet;
+	p->release = Elapsed_Ticks;
+	p->deadline = p->release + deadline;
+	p->job_flags = 0;
+	memset(&p->timing, 0, sizeof(DEADLINE_STATS));
+	Deadline_Insert(p);
+	Enqueue_Ready(p);
+	
+	#ifdef EDF_SCHEDULING
+	Edf_Load += load;
+	#endif
+	
+	return p->pid;
+}
+
+/*TODO: Check for mutex ownership. If PID owns any mutex, ignore this request*/
+static void Kernel_Suspend_Task() 
+{
+	//Finds the process descriptor for the specified PID
+	PD* p = findProcessByPID(Cp->request_arg);
+	
+	//Ensure the PID specified in the PD currently exists in the global process list
+	if(p == NULL)
+	{
+		#ifdef OS_DEBUG
+			printf("Kernel_Suspend_Task: PID not found in global process list!\n");
+		#endif
+		err = PID_NOT_FOUND_ERR;
+		return;
+	}
+	
+	//Ensure the task is not in a unsuspendable state
+	if(p->state == DEAD || p->state == SUSPENDED)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Suspend_Task: Trying to suspend a task that's in an unsuspendable state %d!\n", p->state);
+		#endif
+		err = SUSPEND_NONRUNNING_TASK_ERR;
+		return;
+	}
+	
+	//Ensure the task is not currently owning a mutex
+	if(p->owned != NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Suspend_Task: Trying to suspend a task that currently owns a mutex\n");
+		#endif
+		err = SUSPEND_NONRUNNING_TASK_ERR;
+		return;
+	}
+	
+	//A READY task must leave its ready queue so it won't be dispatched
+	if(p->state == READY)
+		Dequeue_Ready(p);
+	
+	//Save its current state and set it to SUSPENDED
+	p->last_state = p->state;
+	p->state = SUSPENDED;
+	err = NO_ERR;
+}
+
+static void Kernel_Resume_Task()
+{
+	//Finds the process descriptor for the specified PID
+	PD* p = findProcessByPID(Cp->request_arg);
+	
+	//Ensure the PID specified in the PD currently exists in the global process list
+	if(p == NULL)
+	{
+		#ifdef OS_DEBUG
+			printf("Kernel_Resume_Task: PID not found in global process list!\n");
+		#endif
+		err = PID_NOT_FOUND_ERR;
+		return;
+	}
+	
+	//Ensure the task is currently in the SUSPENDED state
+	if(p->state != SUSPENDED)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Resume_Task: Trying to resume a task that's not SUSPENDED!\n");
+		printf("CURRENT STATE: %d\n", p->state);
+		#endif
+		err = RESUME_NONSUSPENDED_TASK_ERR;
+		return;
+	}
+	
+	//Restore the previous state of the task. A task that was READY or RUNNING when suspended goes back into its ready queue.
+	if(p->last_state == READY || p->last_state == RUNNING)
+		Enqueue_Ready(p);
+	else
+		p->state = p->last_state;
+	p->last_state = SUSPENDED;			
+	err = NO_ERR;
+}
+
+/*Ends the current job of a periodic task, which sleeps until its next release. A job that overran its period is released again right away.*/
+static void Kernel_Next_Period(void)
+{
+	if(Cp->period == 0)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Next_Period: PID %d isn't a periodic task!\n", Cp->pid);
+		#endif
+		err = INVALID_ARG_ERR;
+		return;
+	}
+	
+	Job_Done((PD*)Cp);
+	
+	//Releases stay on multiples of the period from the first one
+	Cp->release += Cp->period;
+	Cp->deadline = Cp->release + Cp->rel_deadline;
+	Deadline_Insert((PD*)Cp);
+	Kernel_Sleep_Until((PD*)Cp, Cp->release);
+	err = NO_ERR;
+}
+
+/************************************************************************/
+/*                  EVENT RELATED KERNEL FUNCTIONS                      */
+/************************************************************************/
+
+void Kernel_Create_Event(void)
+{
+	int i;
+	
+	//Make sure the system's events are not at max
 	if(Event_Count >= MAXEVENT)
 	{
 		#ifdef OS_DEBUG
-		printf("Event_Init: Failed to create Event. The system is at its max event threshold.\n");
+		printf("Event_Init: Failed to create Event. The system is at its max event threshold.\n");
+		#endif
+		err = MAX_EVENT_ERR;
+		return;
+	}
+	
+	//Find an uninitialized Event slot
+	for(i=0; i<MAXEVENT; i++)
+		if(Event[i].id == 0) break;
+	
+	//Assign a new handle to the event. Note that a valid Event ID is never 0.
+	Event[i].id = Last_EventID = New_Handle(&Event[i].gen, i);
+	Event[i].owner = 0;
+	++Event_Count;
+	err = NO_ERR;
+	
+	#ifdef OS_DEBUG
+	printf("Event_Init: Created Event %d!\n", Last_EventID);
+	#endif
+}
+
+static void Kernel_Wait_Event(void)
+{
+	EVENT_TYPE* e = findEventByEventID(Cp->request_arg);
+	
+	if(e == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Wait_Event: Error finding requested event!\n");
+		#endif
+		return;
+	}
+	
+	//Ensure no one else is waiting for this same event
+	if(e->owner > 0 && e->owner != Cp->pid)
+	{
+		#ifdef OS_DEBUG
+			printf("Kernel_Wait_Event: The requested event is already being waited by PID %d\n", e->owner);
+		#endif
+		err = EVENT_NOT_FOUND_ERR;
+		return;
+	}
+	
+	//Has this event been signaled already? If yes, "consume" event and keep executing the same task
+	if(e->count > 0)
+	{
+		e->owner = 0;
+		e->count = 0;
+		e->id = 0;
+		--Event_Count;	
+		return;
+	}
+	
+	//Set the owner of the requested event to the current task and put it into the WAIT EVENT state
+	e->owner = Cp->pid;
+	Cp->state = WAIT_EVENT;
+	err = NO_ERR;
+}
+
+static void Kernel_Signal_Event(EVENT id)
+{
+	EVENT_TYPE* e = findEventByEventID(id);
+	PD *e_owner;
+	
+	if(e == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Signal_Event: Error finding requested event!\n");
+		#endif
+		return;
+	}
+	
+	//Increment the event counter if needed 
+	if(MAX_EVENT_SIG_MISS == 0 || e->count < MAX_EVENT_SIG_MISS)
+		e->count++;
+	
+	//If the event is unowned, return
+	if(e->owner == 0)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Signal_Event: *WARNING* The requested event is not being waited by anyone!\n");
+		#endif
+		err = SIGNAL_UNOWNED_EVENT_ERR;
+		return;
+	}
+	
+	//Fetch the owner's PD and ensure it's still valid
+	e_owner = findProcessByPID(e->owner);
+	if(e_owner == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Signal_Event: Event owner's PID not found in global process list!\n");
+		#endif
+		err = PID_NOT_FOUND_ERR;
+		return;
+	}
+	
+	//Wake up the owner of the event by setting its state to READY if it's active. The event is "consumed"
+	if(e_owner->state == WAIT_EVENT)
+	{
+		e->owner = 0;
+		e->count = 0;
+		e->id = 0;
+		--Event_Count;
+		Wake_Task(e_owner);
+	}
+}
+
+/************************************************************************/
+/*                  MUTEX RELATED KERNEL FUNCTIONS                      */
+/************************************************************************/
+
+void Kernel_Create_Mutex(PRIORITY ceiling)
+{
+	int i;
+	
+	if(ceiling != NO_CEILING && ceiling > LOWEST_PRIORITY)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Create_Mutex: Invalid ceiling priority %d!\n", ceiling);
 		#endif
-		err = MAX_EVENT_ERR;
+		err = INVALID_ARG_ERR;
 		return;
 	}
 	
-	//Find an uninitialized Event slot
-	for(i=0; i<MAXEVENT; i++)
-		if(Event[i].id == 0) break;
+	//Make sure the system's mutexes are not at max
+	if(Mutex_Count >= MAXMUTEX)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Create_Mutex: Failed to create Mutex. The system is at its max mutex threshold.\n");
+		#endif
+		err = MAX_MUTEX_ERR;
+		return;
+	}
 	
-	//Assign a new unique ID to the event. Note that the smallest valid Event ID is 1.
-	Event[i].id = ++Last_EventID;
-	Event[i].owner = 0;
-	++Event_Count;
+	//Find an uninitialized Mutex slot
+	for(i=0; i<MAXMUTEX; i++)
+		if(Mutex[i].id == 0) break;
+	
+	//Assign a new handle to the mutex. Note that a valid mutex ID is never 0.
+	Mutex[i].id = Last_MutexID = New_Handle(&Mutex[i].gen, i);
+	Mutex[i].owner = 0;		// note when mutex's owner is 0, it is free
+	Mutex[i].count = 0;
+	Mutex[i].ceiling = ceiling;
+	Mutex[i].waiters.head = NULL;
+	Mutex[i].waiters.tail = NULL;
+	Mutex[i].next_owned = NULL;
+	++Mutex_Count;
 	err = NO_ERR;
 	
 	#ifdef OS_DEBUG
-	printf("Event_Init: Created Event %d!\n", Last_EventID);
+	printf("Kernel_Create_Mutex: Created Mutex %d!\n", Last_MutexID);
 	#endif
 }
 
-static void Kernel_Wait_Event(void)
+static void Dispatch();
+
+/*Gives a free mutex to a task*/
+static void Mutex_Acquire(MUTEX_TYPE *m, PD *p)
 {
-	EVENT_TYPE* e = findEventByEventID(Cp->request_arg);
+	m->owner = p->pid;
+	m->count = 1;
+	m->next_owned = p->owned;
+	p->owned = m;
+}
+
+/*
+ * Recomputes the priority of a mutex owner: its base priority, raised to the ceiling of every mutex it owns and
+ * to that of the highest priority task waiting on any of them.
+ * If the owner is itself waiting on a mutex, the change is passed on along the chain of owners.
+ */
+static void Mutex_Update_Priority(PD *p)
+{
+	MUTEX_TYPE *m;
+	PRIORITY pri;
 	
-	if(e == NULL)
+	while(p != NULL)
+	{
+		//The head of each wait queue is its highest priority waiter
+		pri = p->base_pri;
+		for(m = p->owned; m != NULL; m = m->next_owned)
+		{
+			if(m->ceiling < pri)
+				pri = m->ceiling;
+			if(m->waiters.head != NULL && m->waiters.head->pri < pri)
+				pri = m->waiters.head->pri;
+		}
+		
+		if(pri == p->pri)
+			return;
+		Kernel_Set_Priority(p, pri);
+		
+		//A blocked owner has moved in its wait queue, and may raise (or stop raising) the owner of that mutex
+		m = p->blocked_on;
+		if(m == NULL)
+			return;
+		p = findProcessByPID(m->owner);
+	}
+}
+
+/*Unlocks a mutex held by p completely, handing it over to its highest priority waiter (if any)*/
+static void Mutex_Release(MUTEX_TYPE *m, PD *p)
+{
+	MUTEX_TYPE *prev;
+	PD *next_owner = m->waiters.head;
+	
+	//Take the mutex off the owner's list
+	if(p->owned == m)
+		p->owned = m->next_owned;
+	else
+	{
+		for(prev = p->owned; prev->next_owned != m; prev = prev->next_owned);
+		prev->next_owned = m->next_owned;
+	}
+	m->next_owned = NULL;
+	
+	if(next_owner == NULL)
+	{
+		m->owner = 0;
+		m->count = 0;
+	}
+	else
+	{
+		Queue_Remove(&m->waiters, next_owner);
+		next_owner->blocked_on = NULL;
+		Mutex_Acquire(m, next_owner);
+		
+		//The new owner takes on the ceiling and the priority of the tasks still waiting, before it's queued at its final priority
+		Mutex_Update_Priority(next_owner);
+		
+		Wake_Task(next_owner);
+	}
+	
+	//The old owner no longer inherits from this mutex's waiters
+	Mutex_Update_Priority(p);
+}
+
+static void Kernel_Lock_Mutex(void)
+{
+	MUTEX_TYPE* m = findMutexByMutexID(Cp->request_arg);
+	
+	if(m == NULL)
 	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Wait_Event: Error finding requested event!\n");
+		printf("Kernel_Lock_Mutex: Error finding requested mutex!\n");
 		#endif
 		return;
 	}
 	
-	//Ensure no one else is waiting for this same event
-	if(e->owner > 0 && e->owner != Cp->pid)
+	//Only tasks up to the ceiling priority may use a ceiling mutex, or the ceiling wouldn't keep them out while it's held
+	if(m->ceiling != NO_CEILING && Cp->base_pri < m->ceiling)
 	{
 		#ifdef OS_DEBUG
-			printf("Kernel_Wait_Event: The requested event is already being waited by PID %d\n", e->owner);
+		printf("Kernel_Lock_Mutex: PID %d has a higher priority than the mutex ceiling!\n", Cp->pid);
 		#endif
-		err = EVENT_NOT_FOUND_ERR;
+		err = CEILING_VIOLATION_ERR;
 		return;
 	}
 	
-	//Has this event been signaled already? If yes, "consume" event and keep executing the same task
-	if(e->count > 0)
+	err = NO_ERR;
+	
+	// if mutex is free. The new owner is raised to the mutex's ceiling straight away.
+	if(m->owner == 0)
 	{
-		e->owner = 0;
-		e->count = 0;
-		e->id = 0;
-		--Event_Count;	
+		Mutex_Acquire(m, (PD*)Cp);
+		Mutex_Update_Priority((PD*)Cp);
+		return;
+	} else if (m->owner == Cp->pid) {
+		// if it has locked by the current process
+		++(m->count);
+		return;
+	} else {
+		//Wait in priority order, and lend our priority to the owner (and whoever it's waiting for in turn)
+		Cp->state = WAIT_MUTEX;
+		Cp->blocked_on = m;
+		Queue_Insert_Priority(&m->waiters, (PD*)Cp);
+		Mutex_Update_Priority(findProcessByPID(m->owner));
+	}
+}
+
+static void Kernel_Unlock_Mutex(void)
+{
+	MUTEX_TYPE* m = findMutexByMutexID(Cp->request_arg);
+	
+	if(m == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Unlock_Mutex: Error finding requested mutex!\n");
+		#endif
+		return;
+	}
+	
+	if(m->owner != Cp->pid){
+		#ifdef OS_DEBUG
+		printf("Kernel_Unlock_Mutex: The owner is not the current process\n");
+		#endif
 		return;
 	}
 	
-	//Set the owner of the requested event to the current task and put it into the WAIT EVENT state
-	e->owner = Cp->pid;
-	Cp->state = WAIT_EVENT;
 	err = NO_ERR;
+	
+	// M is locked more than once
+	if (m->count > 1)
+		--(m->count);
+	else
+		Mutex_Release(m, (PD*)Cp);		//A waiter with a higher priority than ours preempts us once the request is done
 }
 
-static void Kernel_Signal_Event(void)
+/************************************************************************/
+/*                SEMAPHORE RELATED KERNEL FUNCTIONS                    */
+/************************************************************************/
+
+void Kernel_Create_Sem(unsigned int count)
 {
-	EVENT_TYPE* e = findEventByEventID(Cp->request_arg);
-	PD *e_owner;
+	int i;
 	
-	if(e == NULL)
+	//Make sure the system's semaphores are not at max
+	if(Sem_Count >= MAXSEM)
 	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Signal_Event: Error finding requested event!\n");
+		printf("Kernel_Create_Sem: Failed to create semaphore. The system is at its max semaphore threshold.\n");
 		#endif
+		err = MAX_SEM_ERR;
 		return;
 	}
 	
-	//Increment the event counter if needed 
-	if(MAX_EVENT_SIG_MISS == 0 || e->count < MAX_EVENT_SIG_MISS)
-		e->count++;
+	//Find an uninitialized semaphore slot
+	for(i=0; i<MAXSEM; i++)
+		if(Sem[i].id == 0) break;
+	
+	//Assign a new handle to the semaphore. Note that a valid semaphore ID is never 0.
+	Sem[i].id = Last_SemID = New_Handle(&Sem[i].gen, i);
+	Sem[i].count = count;
+	Sem[i].waiters.head = NULL;
+	Sem[i].waiters.tail = NULL;
+	++Sem_Count;
+	err = NO_ERR;
+	
+	#ifdef OS_DEBUG
+	printf("Kernel_Create_Sem: Created semaphore %d!\n", Last_SemID);
+	#endif
+}
+
+static void Kernel_Wait_Sem(void)
+{
+	SEM_TYPE* s = findSemBySemID(Cp->request_arg);
+	
+	if(s == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Wait_Sem: Error finding requested semaphore!\n");
+		#endif
+		return;
+	}
+	
+	err = NO_ERR;
+	
+	//Take a unit if there's one left and keep executing the same task
+	if(s->count > 0)
+	{
+		--(s->count);
+		return;
+	}
+	
+	//Otherwise wait in priority order for the next post
+	Cp->state = WAIT_SEM;
+	Queue_Insert_Priority(&s->waiters, (PD*)Cp);
+}
+
+static void Kernel_Post_Sem(SEMAPHORE id)
+{
+	SEM_TYPE* s = findSemBySemID(id);
+	PD *p;
+	
+	if(s == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Post_Sem: Error finding requested semaphore!\n");
+		#endif
+		return;
+	}
+	
+	err = NO_ERR;
+	
+	//Nobody is waiting, so keep the unit for the next Sem_Wait
+	p = s->waiters.head;
+	if(p == NULL)
+	{
+		++(s->count);
+		return;
+	}
+	
+	//The unit goes straight to the highest priority waiter
+	Queue_Remove(&s->waiters, p);
+	Wake_Task(p);
+}
+
+/************************************************************************/
+/*              MESSAGE QUEUE RELATED KERNEL FUNCTIONS                  */
+/************************************************************************/
+
+/*Returns the buffer a message (as seen by tasks) belongs to, or NULL if it isn't the data of a buffer from the pool*/
+static MSG_BUFFER* Msg_Buffer(void *msg)
+{
+	unsigned char *data = (unsigned char*)msg;
+	unsigned char *first = Msg_Pool[0].data;
+	
+	if(data < first || data > Msg_Pool[MSG_POOL_SIZE-1].data || (data - first) % sizeof(MSG_BUFFER) != 0)
+		return NULL;
+	
+	return (MSG_BUFFER*)(data - offsetof(MSG_BUFFER, data));
+}
+
+/*Returns the buffer of a message Cp holds, or NULL if it isn't a buffer from the pool or Cp doesn't hold it (e.g. it was already sent or freed)*/
+static MSG_BUFFER* Owned_Msg_Buffer(void *msg)
+{
+	MSG_BUFFER *b = Msg_Buffer(msg);
+	
+	if(b == NULL || b->owner != Cp->pid)
+		return NULL;
+	return b;
+}
+
+void Kernel_Create_MsgQ(unsigned int capacity)
+{
+	int i;
+	
+	if(capacity == 0)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Create_MsgQ: A message queue must hold at least one message!\n");
+		#endif
+		err = INVALID_ARG_ERR;
+		return;
+	}
+	
+	//Make sure the system's message queues are not at max
+	if(MsgQ_Count >= MAXMSGQ)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Create_MsgQ: Failed to create message queue. The system is at its max message queue threshold.\n");
+		#endif
+		err = MAX_MSGQ_ERR;
+		return;
+	}
+	
+	//Find an uninitialized message queue slot
+	for(i=0; i<MAXMSGQ; i++)
+		if(MsgQ[i].id == 0) break;
+	
+	//Assign a new handle to the queue. Note that a valid queue ID is never 0.
+	MsgQ[i].id = Last_MsgQID = New_Handle(&MsgQ[i].gen, i);
+	MsgQ[i].capacity = capacity;
+	MsgQ[i].count = 0;
+	MsgQ[i].head = NULL;
+	MsgQ[i].tail = NULL;
+	MsgQ[i].senders.head = NULL;
+	MsgQ[i].senders.tail = NULL;
+	MsgQ[i].receivers.head = NULL;
+	MsgQ[i].receivers.tail = NULL;
+	++MsgQ_Count;
+	err = NO_ERR;
+	
+	#ifdef OS_DEBUG
+	printf("Kernel_Create_MsgQ: Created message queue %d!\n", Last_MsgQID);
+	#endif
+}
+
+/*Takes a buffer from the pool for Cp, returned through its request_data. Cp waits for one if the pool is empty.*/
+static void Kernel_Alloc_Msg(void)
+{
+	MSG_BUFFER *b = Free_Msgs;
+	
+	err = NO_ERR;
+	if(b == NULL)
+	{
+		Cp->request_data = NULL;
+		Cp->state = WAIT_BUFFER;
+		Queue_Insert_Priority(&Msg_Waiters, (PD*)Cp);
+		return;
+	}
+	
+	Free_Msgs = b->next;
+	b->next = NULL;
+	b->owner = Cp->pid;
+	Cp->request_data = b->data;
+}
+
+/*Gives Cp's buffer back to the pool, or straight to the highest priority task waiting for one*/
+static void Kernel_Free_Msg(void)
+{
+	MSG_BUFFER *b = Owned_Msg_Buffer(Cp->request_data);
+	PD *p = Msg_Waiters.head;
+	
+	if(b == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Free_Msg: Not a message buffer held by PID %d!\n", Cp->pid);
+		#endif
+		err = INVALID_ARG_ERR;
+		return;
+	}
+	
+	err = NO_ERR;
+	if(p != NULL)
+	{
+		Queue_Remove(&Msg_Waiters, p);
+		b->owner = p->pid;
+		p->request_data = b->data;
+		Wake_Task(p);
+		return;
+	}
+	
+	b->owner = 0;
+	b->next = Free_Msgs;
+	Free_Msgs = b;
+}
+
+/*Passes Cp's buffer to a message queue: to the highest priority receiver if one is waiting, else into the queue. Cp waits while the queue is full.*/
+static void Kernel_Send_Msg(void)
+{
+	MSGQ_TYPE *q = findMsgQByMsgQID(Cp->request_arg);
+	MSG_BUFFER *b = Owned_Msg_Buffer(Cp->request_data);
+	PD *p;
+	
+	//A buffer that is already queued, freed or held by another task can't be sent, or it would end up in two lists
+	if(q == NULL || b == NULL)
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Send_Msg: Error finding requested message queue or a buffer held by PID %d!\n", Cp->pid);
+		#endif
+		if(b == NULL)
+			err = INVALID_ARG_ERR;
+		return;
+	}
+	
+	err = NO_ERR;
+	
+	//A waiting receiver means the queue is empty, so the message goes straight to it
+	p = q->receivers.head;
+	if(p != NULL)
+	{
+		Queue_Remove(&q->receivers, p);
+		b->owner = p->pid;
+		p->request_data = b->data;
+		Wake_Task(p);
+		return;
+	}
+	
+	//Wait for room, holding on to the message
+	if(q->count >= q->capacity)
+	{
+		Cp->state = WAIT_SEND;
+		Queue_Insert_Priority(&q->senders, (PD*)Cp);
+		return;
+	}
+	
+	b->owner = 0;
+	b->next = NULL;
+	if(q->tail == NULL)
+		q->head = b;
+	else
+		q->tail->next = b;
+	q->tail = b;
+	++(q->count);
+}
+
+/*Takes the oldest message from a queue for Cp, returned through its request_data. Cp waits if the queue is empty.*/
+static void Kernel_Receive_Msg(void)
+{
+	MSGQ_TYPE *q = findMsgQByMsgQID(Cp->request_arg);
+	MSG_BUFFER *b;
+	PD *p;
 	
-	//If the event is unowned, return
-	if(e->owner == 0)
+	Cp->request_data = NULL;
+	if(q == NULL)
 	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Signal_Event: *WARNING* The requested event is not being waited by anyone!\n");
+		printf("Kernel_Receive_Msg: Error finding requested message queue!\n");
 		#endif
-		err = SIGNAL_UNOWNED_EVENT_ERR;
 		return;
 	}
 	
-	//Fetch the owner's PD and ensure it's still valid
-	e_owner = findProcessByPID(e->owner);
-	if(e_owner == NULL)
+	err = NO_ERR;
+	b = q->head;
+	if(b == NULL)
 	{
-		#ifdef OS_DEBUG
-		printf("Kernel_Signal_Event: Event owner's PID not found in global process list!\n");
-		#endif
-		err = PID_NOT_FOUND_ERR;
+		Cp->state = WAIT_RECEIVE;
+		Queue_Insert_Priority(&q->receivers, (PD*)Cp);
 		return;
 	}
 	
-	//Wake up the owner of the event by setting its state to READY if it's active. The event is "consumed"
-	if(e_owner->state == WAIT_EVENT)
+	q->head = b->next;
+	if(q->head == NULL)
+		q->tail = NULL;
+	b->next = NULL;
+	b->owner = Cp->pid;
+	--(q->count);
+	Cp->request_data = b->data;
+	
+	//The room just made goes to the highest priority sender waiting for it
+	p = q->senders.head;
+	if(p != NULL)
 	{
-		e->owner = 0;
-		e->count = 0;
-		e->id = 0;
-		--Event_Count;
-		e_owner->state = READY;
+		Queue_Remove(&q->senders, p);
+		b = Msg_Buffer(p->request_data);
+		b->owner = 0;
+		b->next = NULL;
+		if(q->tail == NULL)
+			q->head = b;
+		else
+			q->tail->next = b;
+		q->tail = b;
+		++(q->count);
+		Wake_Task(p);
 	}
 }
 
 /************************************************************************/
-/*                  MUTEX RELATED KERNEL FUNCTIONS                      */
+/*               EVENT FLAG GROUP RELATED KERNEL FUNCTIONS              */
 /************************************************************************/
 
-void Kernel_Create_Mutex(void)
+void Kernel_Create_Flags(void)
 {
 	int i;
 	
-	//Make sure the system's mutexes are not at max
-	if(Mutex_Count >= MAXMUTEX)
+	//Make sure the system's event flag groups are not at max
+	if(Flags_Count >= MAXFLAGS)
 	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Create_Mutex: Failed to create Mutex. The system is at its max mutex threshold.\n");
+		printf("Kernel_Create_Flags: Failed to create event flag group. The system is at its max event flag group threshold.\n");
 		#endif
-		err = MAX_MUTEX_ERR;
+		err = MAX_FLAGS_ERR;
 		return;
 	}
 	
-	//Find an uninitialized Mutex slot
-	for(i=0; i<MAXMUTEX; i++)
-		if(Mutex[i].id == 0) break;
+	//Find an uninitialized event flag group slot
+	for(i=0; i<MAXFLAGS; i++)
+		if(Flags[i].id == 0) break;
 	
-	//Assign a new unique ID to the mutex. Note that the smallest valid mutex ID is 1.
-	Mutex[i].id = ++Last_MutexID;
-	Mutex[i].owner = 0;		// note when mutex's owner is 0, it is free
-	// init priority stack
-	for (int j=0; j<MAXTHREAD; j++) {
-		Mutex[i].priority_stack[j] = LOWEST_PRIORITY+1;
-		Mutex[i].blocked_stack[j] = -1;
-		Mutex[i].order[j] = 0;
-	}
-	Mutex[i].num_of_process = 0;
-	Mutex[i].total_num = 0;
-	++Mutex_Count;
+	//Assign a new handle to the group. Note that a valid group ID is never 0.
+	Flags[i].id = Last_FlagsID = New_Handle(&Flags[i].gen, i);
+	Flags[i].flags = 0;
+	Flags[i].waiters.head = NULL;
+	Flags[i].waiters.tail = NULL;
+	++Flags_Count;
 	err = NO_ERR;
 	
 	#ifdef OS_DEBUG
-	printf("Kernel_Create_Mutex: Created Mutex %d!\n", Last_MutexID);
+	printf("Kernel_Create_Flags: Created event flag group %d!\n", Last_FlagsID);
 	#endif
 }
 
-static void Dispatch();
+/*Returns the flags of a waiter's mask that are set, or 0 if its condition isn't met yet*/
+static unsigned int Flags_Match(unsigned int flags, FLAGS_ARGS *args)
+{
+	unsigned int matched = flags & args->mask;
+	
+	if((args->mode & FLAGS_ALL) && matched != args->mask)
+		return 0;
+	
+	return matched;
+}
 
-static void Kernel_Lock_Mutex(void)
+static void Kernel_Wait_Flags(void)
 {
-	MUTEX_TYPE* m = findMutexByMutexID(Cp->request_arg);
-	PD *m_owner = findProcessByPID(m->owner);
+	FLAGS_TYPE *f = findFlagsByFlagsID(Cp->request_arg);
+	FLAGS_ARGS *args = (FLAGS_ARGS*)Cp->request_data;
 	
-	if(m == NULL)
+	if(f == NULL)
 	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Lock_Mutex: Error finding requested mutex!\n");
+		printf("Kernel_Wait_Flags: Error finding requested event flag group!\n");
 		#endif
 		return;
 	}
 	
-	// if mutex is free
-	if(m->owner == 0)
+	//A waiter with an empty mask would never be woken up
+	if(args->mask == 0)
 	{
-		m->owner = Cp->pid;
-		m->count = 1;
-		m->own_pri = Cp->pri;				// keep track of the original priority of the owner
+		err = INVALID_ARG_ERR;
 		return;
-	} else if (m->owner == Cp->pid) {
-		// if it has locked by the current process
-		++(m->count);
+	}
+	
+	err = NO_ERR;
+	
+	//The condition is already met, keep executing the same task
+	args->result = Flags_Match(f->flags, args);
+	if(args->result != 0)
+	{
+		if(args->mode & FLAGS_CLEAR)
+			f->flags &= ~args->result;
 		return;
-	} else {
-		Cp->state = WAIT_MUTEX;								//put cp into state wait mutex
-		//enqueue cp to stack
-		++(m->num_of_process);
-		++(m->total_num);
-		for (int i=0; i<MAXTHREAD; i++) {
-			if (m->blocked_stack[i] == -1){
-				m->blocked_stack[i] = Cp->pid;
-				m->order[i] = m->total_num;
-				m->priority_stack[i] = Cp->pri;
-				break;	
-			}
-		}
-		// end of enqueue
-		
-		//if cp's priority is higher than the owner
-		if (Cp->pri < m_owner->pri) {
-			m_owner->pri = Cp->pri;				// the owner gets cp's priority
-		}
-		Dispatch();
 	}
+	
+	Cp->state = WAIT_FLAGS;
+	Queue_Insert_Priority(&f->waiters, (PD*)Cp);
 }
 
-static void Kernel_Unlock_Mutex(void)
+/*Sets flags in a group, and wakes every waiter whose condition is now met in priority order. The flags some of them asked to clear are cleared once they're all woken.*/
+static void Kernel_Set_Flags(void)
 {
-	MUTEX_TYPE* m = findMutexByMutexID(Cp->request_arg);
-	PD *m_owner = findProcessByPID(m->owner);
+	FLAGS_TYPE *f = findFlagsByFlagsID(Cp->request_arg);
+	PD *p;
+	PD *next;
+	FLAGS_ARGS *args;
+	unsigned int clear = 0;
 	
-	if(m == NULL)
+	if(f == NULL)
 	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Unlock_Mutex: Error finding requested mutex!\n");
+		printf("Kernel_Set_Flags: Error finding requested event flag group!\n");
 		#endif
 		return;
 	}
 	
-	if(m->owner != Cp->pid){
+	err = NO_ERR;
+	f->flags |= ((FLAGS_ARGS*)Cp->request_data)->mask;
+	
+	for(p = f->waiters.head; p != NULL; p = next)
+	{
+		next = p->next;
+		args = (FLAGS_ARGS*)p->request_data;
+		args->result = Flags_Match(f->flags, args);
+		if(args->result == 0)
+			continue;
+		
+		if(args->mode & FLAGS_CLEAR)
+			clear |= args->result;
+		Queue_Remove(&f->waiters, p);
+		Wake_Task(p);
+	}
+	
+	f->flags &= ~clear;
+}
+
+static void Kernel_Clear_Flags(void)
+{
+	FLAGS_TYPE *f = findFlagsByFlagsID(Cp->request_arg);
+	
+	if(f == NULL)
+	{
 		#ifdef OS_DEBUG
-		printf("Kernel_Unlock_Mutex: The owner is not the current process\n");
+		printf("Kernel_Clear_Flags: Error finding requested event flag group!\n");
 		#endif
 		return;
-	} else if (m->count > 1) {
-		// M is locked more than once
-		--(m->count);
-	} else if (m->num_of_process > 0) {
-		// there are tasks waiting on the mutex
-		// deque the task with highest priority
-		PID p_dequeue = 0;
-		unsigned int temp_order = m->total_num + 1;
-		PRIORITY temp_pri = LOWEST_PRIORITY + 1;
-		int i;
-		for (i=0; i<MAXTHREAD; i++) {
-			if (m->priority_stack[i] < temp_pri) {
-				// found a task with higher priority
-				temp_pri = m->priority_stack[i];
-				temp_order = m->order[i];
-				p_dequeue = m->blocked_stack[i];
-			} else if (m->priority_stack[i] == temp_pri && temp_order < m->order[i]) {
-				// same priority and came into the queue earlier
-				temp_order = m->order[i];
-				p_dequeue = m->blocked_stack[i];
-			}
-		}
-		//dequeue index i
-		m->blocked_stack[i] = -1;
-		m->priority_stack[i] = LOWEST_PRIORITY+1;
-		m->order[i] = 0;
-		--(m->num_of_process);
-		PD* target_p = findProcessByPID(p_dequeue);
-		m_owner->pri = m->own_pri;		//reset owner's priority
-		m->owner = p_dequeue;
-		m->own_pri = temp_pri;			//keep track of new owner's priority;
-		target_p->state = READY;
-		Cp->state = READY;
-		Dispatch();
-		return;
-	} else {
-		m->owner = 0;
-		m->count = 0;
-		m_owner->pri = m->own_pri;		//reset owner's priority
-		return;
 	}
+	
+	err = NO_ERR;
+	f->flags &= ~((FLAGS_ARGS*)Cp->request_data)->mask;
+}
+
+/************************************************************************/
+/*                    BLOCKING REQUEST TIMEOUTS                         */
+/************************************************************************/
+
+/*Blocks Cp on whatever its request is now waiting for, for at most request_timeout ticks (0 = forever), and runs another task*/
+static void Kernel_Block(void)
+{
+	if(Cp->request_timeout > 0)
+	{
+		Sleep_Insert((PD*)Cp, Cp->request_timeout);
+		Cp->timed = 1;
+	}
+	Dispatch();
+}
+
+/*
+ * Takes a task whose wait has timed out off whatever it was waiting on, so it can be made READY again.
+ * It leaves empty handed: the object it waited for is left as if it had never asked. The handle of the object
+ * is still in its request_arg, and stays valid since objects are never destroyed while a task waits on them.
+ */
+static void Kernel_Cancel_Wait(PD *p)
+{
+	PROCESS_STATES state = (p->state == SUSPENDED) ? p->last_state : p->state;
+	volatile PD_QUEUE *q = Wait_Queue(p);
+	MUTEX_TYPE *m;
+	
+	//A sender that times out keeps its message
+	if(q != NULL)
+		Queue_Remove(q, p);
+	
+	if(state == WAIT_EVENT)
+		findEventByEventID(p->request_arg)->owner = 0;
+	else if(state == WAIT_MUTEX)
+	{
+		//The owner no longer inherits our priority
+		m = p->blocked_on;
+		p->blocked_on = NULL;
+		Mutex_Update_Priority(findProcessByPID(m->owner));
+	}
+	
+	p->wait_status = WAIT_TIMEOUT;
 }
 
 /************************************************************************/
@@ -611,47 +2347,20 @@ static void Kernel_Unlock_Mutex(void)
 
 static void Kernel_Terminate_Task(void)
 {
-	MUTEX_TYPE* m;
-	// go through all mutex check if it owns a mutex
-	int index;
-	for (index=0; index<MAXMUTEX; index++) {
-		if (Mutex[index].owner == Cp->pid) {
-			// it owns a mutex unlock the mutex
-			if (Mutex[index].num_of_process > 0) {
-				printf("something is waiting\n");
-				// if there are other process waiting on the mutex
-				PID p_dequeue = 0;
-				unsigned int temp_order = Mutex[index].total_num + 1;
-				PRIORITY temp_pri = LOWEST_PRIORITY + 1;
-				int i;
-				for (i=0; i<MAXTHREAD; i++) {
-					if (Mutex[index].priority_stack[i] < temp_pri) {
-						// found a task with higher priority
-						temp_pri = Mutex[index].priority_stack[i];
-						temp_order = Mutex[index].order[i];
-						p_dequeue = Mutex[index].blocked_stack[i];
-						} else if (Mutex[index].priority_stack[i] == temp_pri && temp_order < Mutex[index].order[i]) {
-						// same priority and came into the queue earlier
-						temp_order = Mutex[index].order[i];
-						p_dequeue = Mutex[index].blocked_stack[i];
-					}
-				}
-				//dequeue index i
-				Mutex[index].blocked_stack[i] = -1;
-				Mutex[index].priority_stack[i] = LOWEST_PRIORITY+1;
-				Mutex[index].order[i] = 0;
-				--(Mutex[index].num_of_process);
-				PD* target_p = findProcessByPID(p_dequeue);
-				Mutex[index].owner = p_dequeue;
-				Mutex[index].own_pri = temp_pri;			//keep track of new owner's priority;
-				target_p->state = READY;
-				printf("target p is readd\n");
-			} else {
-				Mutex[index].owner = 0;
-				Mutex[index].count = 0;
-			}
-		}
-	}
+	//Every mutex the task still holds is handed over to its waiters
+	while(Cp->owned != NULL)
+		Mutex_Release(Cp->owned, (PD*)Cp);
+	
+	//A dead task's job can't miss its deadline any more
+	if(Cp->period != 0 && !(Cp->job_flags & JOB_MISSED))
+		Deadline_Remove((PD*)Cp);
+	
+	#ifdef EDF_SCHEDULING
+	//Make room for new periodic tasks
+	if(Cp->period != 0)
+		Edf_Load -= ((unsigned long)Cp->wcet * EDF_FULL_LOAD + Cp->rel_deadline - 1) / Cp->rel_deadline;
+	#endif
+	
 	Cp->state = DEAD;			//Mark the task as DEAD so its resources will be recycled later when new tasks are created
 	--Task_Count;
 }
@@ -660,153 +2369,367 @@ static void Kernel_Terminate_Task(void)
 /*                     KERNEL SCHEDULING FUNCTIONS                      */
 /************************************************************************/
 
-/* This internal kernel function is a part of the "scheduler". It chooses the next task to run, i.e., Cp. */
-static void Dispatch()
+/*
+  * Queues a request from an interrupt handler. It's carried out on the next kernel entry, which is at most one tick away
+  * (or right away if the kernel is idle). Safe to call with interrupts disabled, never enters the kernel itself.
+  */
+void Kernel_Request_FromISR(KERNEL_REQUEST_TYPE request, int arg)
 {
-	unsigned int i = 0;
-	int highest_pri = LOWEST_PRIORITY + 1;
-	int highest_pri_index = -1;
+	unsigned char sreg = SREG;
+	unsigned char tail;
 	
-	//Find the next READY task with the highest priority by iterating through the process list ONCE
-	for(i=0; i<MAXTHREAD; i++)
+	Disable_Interrupt();
+	tail = ISR_Queue_Tail;
+	
+	//Drop the request if the kernel hasn't caught up yet
+	if(((tail + 1) & (ISR_QUEUE_SIZE - 1)) == ISR_Queue_Head)
+		++ISR_Queue_Dropped;
+	else
 	{
-		//Increment process index
-		NextP = (NextP + 1) % MAXTHREAD;
-		
-		//Select the READY process with the highest priority
-		if(Process[NextP].state == READY && Process[NextP].pri < highest_pri)
+		ISR_Queue[tail].request = request;
+		ISR_Queue[tail].arg = arg;
+		ISR_Queue_Tail = (tail + 1) & (ISR_QUEUE_SIZE - 1);
+	}
+	SREG = sreg;
+}
+
+/* Carries out every request left by interrupt handlers since the last kernel entry. */
+static void Kernel_Drain_ISR_Queue()
+{
+	ERROR_TYPE saved_err;
+	
+	if(ISR_Queue_Head == ISR_Queue_Tail)
+		return;
+	
+	//The error code belongs to the request of the current task, not to the ISR's requests
+	saved_err = err;
+	while(ISR_Queue_Head != ISR_Queue_Tail)
+	{
+		Trace(TRACE_ISR_REQUEST, TRACE_NO_TASK, ISR_Queue[ISR_Queue_Head].request);
+		switch(ISR_Queue[ISR_Queue_Head].request)
 		{
-			highest_pri = Process[NextP].pri;
-			highest_pri_index = NextP;
+			case SIGNAL_E:
+			Kernel_Signal_Event(ISR_Queue[ISR_Queue_Head].arg);
+			break;
+			
+			case POST_S:
+			Kernel_Post_Sem(ISR_Queue[ISR_Queue_Head].arg);
+			break;
+			
+			//Other requests would need a calling task, ignore them
+			default:
+			break;
 		}
+		ISR_Queue_Head = (ISR_Queue_Head + 1) & (ISR_QUEUE_SIZE - 1);
 	}
-		
+	err = saved_err;
+}
+
+/* This internal kernel function is a part of the "scheduler". It chooses the next task to run, i.e., Cp. */
+static void Dispatch()
+{
+	PRIORITY pri;
+	
+	STATS_COUNT(dispatches);
+	
+	//Whoever had the CPU until now is charged for it
+	Account_Time();
+	
+	//If the task that made the request can still run, it goes behind the other READY tasks of the same priority
+	if(Cp != NULL)
+	{
+		if(Cp->state == RUNNING)
+			Enqueue_Ready((PD*)Cp);
+		Trace(TRACE_SWITCH_OUT, TRACE_TASK(Cp), Cp->state);
+	}
+	
 	//When none of the tasks in the process list is ready
-	if(highest_pri_index == -1)
+	if(Ready_Bitmap == 0)
 	{
-		//We'll temporarily re-enable interrupt in case if one or more task is waiting on events/interrupts or sleeping
-		Enable_Interrupt();
+		Kernel_Idle = 1;
+		Trace(TRACE_IDLE, TRACE_NO_TASK, 0);
 		
-		//Looping through the process list until any process becomes ready
-		while(Process[NextP].state != READY)
+		//Wait until any process becomes ready
+		while(Ready_Bitmap == 0)
 		{
-			//Increment process index
-			NextP = (NextP + 1) % MAXTHREAD;
+			STATS_COUNT(idle_loops);
+			Stats_Pause();
 			
-			//Check if any timer ticks came in
+			//Program the timer to wake us up when the next sleeping task or deadline is due, or as late as possible if there's neither
+			Timer_Skip_Ticks(Idle_Wake_Ticks());
+			
+			//Re-enable interrupts and sleep until one arrives. The instruction following sei always executes first, so no interrupt can be missed in between.
+			set_sleep_mode(SLEEP_MODE_IDLE);
+			sleep_enable();
+			Enable_Interrupt();
+			sleep_cpu();
+			sleep_disable();
+			
+			//Interrupts must be disabled again before touching the kernel's data.
+			Disable_Interrupt();
+			Timer_Resume_Ticks();
+			Idle_Ticks += Tick_Count;
+			Stats_Resume();
+			
+			//Check if any timer ticks or requests from interrupt handlers came in
 			Kernel_Tick_Handler();	
+			Kernel_Drain_ISR_Queue();
 		}
 		
-		//Now that we have a ready task, interrupts must be disabled for the kernel to function properly again.
-		Disable_Interrupt();
+		Account_Time();
+		Kernel_Idle = 0;
 	}
-	else
-		NextP = highest_pri_index;
+	
+	//Take the task at the front of the highest priority non-empty ready queue
+	pri = Highest_Ready_Priority();
+	Cp = Ready_Queue[pri].head;
+	Dequeue_Ready((PD*)Cp);
 
-	//Load the next selected task's process descriptor into Cp
-	Cp = &(Process[NextP]);
-	CurrentSp = Cp->sp;
+	//The selected task's context is restored once the kernel returns to cswitch.s
 	Cp->state = RUNNING;
+	Trace(TRACE_SWITCH_IN, TRACE_TASK(Cp), Cp->pri);
+	
+	//The first dispatch of a job tells how long after its release it got the CPU
+	if(Cp->period != 0 && !(Cp->job_flags & JOB_STARTED))
+		Job_Start((PD*)Cp);
+}
+
+/*
+ * Hands the handle of the object a CREATE request has just made, or 0 if that failed, to the caller through its request_data.
+ * Last_xID can't be read once the kernel has returned, since by then another task may have run and created an object of its own.
+ */
+static void Return_Handle(unsigned int id)
+{
+	*(unsigned int*)Cp->request_data = (err == NO_ERR) ? id : 0;
+}
+
+/* Switches away from the running task if a task with a higher priority is READY, e.g. one woken by the tick or an ISR. The preempted task keeps the rest of its slice. */
+static void Kernel_Check_Preempt()
+{
+	if(Cp->state != RUNNING)
+		return;
+	
+	#ifdef EDF_SCHEDULING
+	//A task of the same priority preempts too if its deadline is nearer
+	if((Ready_Bitmap & ((1 << Cp->pri) - 1)) || 
+	   (Ready_Queue[Cp->pri].head != NULL && Earlier_Deadline(Ready_Queue[Cp->pri].head, (PD*)Cp)))
+	#else
+	if(Ready_Bitmap & ((1 << Cp->pri) - 1))
+	#endif
+	{
+		Enqueue_Ready_Front((PD*)Cp);
+		Dispatch();
+	}
 }
 
 /**
-  * This internal kernel function is the "main" driving loop of this full-served
-  * model architecture. Basically, on OS_Start(), the kernel repeatedly
-  * requests the next user task's next system call and then invokes the
-  * corresponding kernel function on its behalf.
+  * This internal kernel function handles the system call (or preemption) of Cp.
+  * It's called by Enter_Kernel() (or the timer tick ISR) in cswitch.s on the kernel's stack,
+  * after only the stack pointer of Cp has been saved into CurrentSp.
   *
-  * This is the main loop of our kernel, called by OS_Start().
+  * Returns KEEP_RUNNING if Cp keeps running. Since this is a normal C function call, Cp's call-saved
+  * registers are still intact and Enter_Kernel() returns to it straight away.
+  * Otherwise, cswitch.s saves Cp's context on its own stack (SWITCH_SAVE) and calls Kernel_Switch_Task() 
+  * to go straight to the newly dispatched task, without ever switching to a kernel context.
+  * A task that has died never runs again, so its context isn't saved at all (SWITCH_DISCARD).
+  * That matters when it was terminated for overflowing its stack, as there's no room left on it.
   */
-static void Next_Kernel_Request() 
+unsigned char Kernel_Handle_Request() 
 {
-	Dispatch();	//Select an initial task to run
+	#ifdef OS_STATS
+	KERNEL_REQUEST_TYPE request;
+	#endif
+	
+	Stats_Begin();
+	Switched_From = (PD*)Cp;
+	
+	//A task that has overflowed its stack is terminated before it can do more damage
+	if(!Stack_Intact((PD*)Cp))
+	{
+		#ifdef OS_DEBUG
+		printf("Kernel_Handle_Request: PID %d has overflowed its stack and is terminated!\n", Cp->pid);
+		#endif
+		Cp->request = TERMINATE;
+		err = STACK_OVERFLOW_ERR;
+	}
+	Trace(TRACE_REQUEST, TRACE_TASK(Cp), Cp->request);
+	
+	#ifdef OS_STATS
+	request = Cp->request;
+	#endif
+	
+	//Check if any timer ticks or requests from interrupt handlers came in
+	Kernel_Tick_Handler();
+	Kernel_Drain_ISR_Queue();
+
+	switch(Cp->request)
+	{
+		case CREATE_T:
+		{
+			CREATE_ARGS *args = (CREATE_ARGS*)Cp->request_data;
+			if(args->period == 0)
+				args->pid = Kernel_Create_Task(args->code, args->pri, args->arg, args->stack_size);
+			else
+				args->pid = Kernel_Create_Periodic_Task(args->code, args->pri, args->arg, args->stack_size, args->period, args->deadline, args->wcet);
+		}
+		break;
+		
+		case TERMINATE:
+		Kernel_Terminate_Task();
+		Dispatch();					//Dispatch is only needed if the syscall requires running a different task  after it's done
+		break;
+	   
+		case SUSPEND:
+		Kernel_Suspend_Task();
+		if(Cp->state != RUNNING) Dispatch();
+		break;
+		
+		case RESUME:
+		Kernel_Resume_Task();
+		Dispatch();
+		break;
+		
+		case SLEEP:
+		Kernel_Sleep_Task((PD*)Cp, Cp->request_arg);
+		Dispatch();					
+		break;
+		
+		case SLEEP_UNTIL:
+		Kernel_Sleep_Until((PD*)Cp, Cp->request_arg);
+		if(Cp->state != RUNNING) Dispatch();	//A late task keeps running
+		break;
+		
+		case NEXT_PERIOD:
+		Kernel_Next_Period();
+		Dispatch();						//A late task gets a new deadline, so it has to be queued again
+		break;
+		
+		case CREATE_E:
+		Kernel_Create_Event();
+		Return_Handle(Last_EventID);
+		break;
+		
+		case WAIT_E:
+		Kernel_Wait_Event();	
+		if(Cp->state != RUNNING) Kernel_Block();	//Don't dispatch to a different task if the event is already siganlled
+		break;
+		
+		case SIGNAL_E:
+		Kernel_Signal_Event(Cp->request_arg);
+		Dispatch();
+		break;
+		
+		case CREATE_M:
+		Kernel_Create_Mutex(Cp->request_arg);
+		Return_Handle(Last_MutexID);
+		break;
+		
+		case LOCK_M:
+		Kernel_Lock_Mutex();
+		if(Cp->state != RUNNING) Kernel_Block();	//Only switch tasks if the mutex is held by another task
+		break;
+		
+		case UNLOCK_M:
+		Kernel_Unlock_Mutex();		//A woken waiter, or our own dropped inheritance, is handled by Kernel_Check_Preempt below
+		break;
+		
+		case CREATE_S:
+		Kernel_Create_Sem(Cp->request_arg);
+		Return_Handle(Last_SemID);
+		break;
+		
+		case WAIT_S:
+		Kernel_Wait_Sem();
+		if(Cp->state != RUNNING) Kernel_Block();	//Only switch tasks if no unit was left
+		break;
+		
+		case POST_S:
+		Kernel_Post_Sem(Cp->request_arg);		//A woken task with a higher priority preempts us once the request is done
+		break;
+		
+		case CREATE_Q:
+		Kernel_Create_MsgQ(Cp->request_arg);
+		Return_Handle(Last_MsgQID);
+		break;
+		
+		case SEND_Q:
+		Kernel_Send_Msg();
+		if(Cp->state != RUNNING) Kernel_Block();	//Only switch tasks if the queue is full
+		break;
+		
+		case RECEIVE_Q:
+		Kernel_Receive_Msg();
+		if(Cp->state != RUNNING) Kernel_Block();	//Only switch tasks if the queue is empty
+		break;
+		
+		case ALLOC_MSG:
+		Kernel_Alloc_Msg();
+		if(Cp->state != RUNNING) Kernel_Block();	//Only switch tasks if the pool is empty
+		break;
+		
+		case FREE_MSG:
+		Kernel_Free_Msg();
+		break;
+		
+		case CREATE_F:
+		Kernel_Create_Flags();
+		Return_Handle(Last_FlagsID);
+		break;
+		
+		case WAIT_F:
+		Kernel_Wait_Flags();
+		if(Cp->state != RUNNING) Kernel_Block();	//Only switch tasks if the flags aren't set yet
+		break;
+		
+		case SET_F:
+		Kernel_Set_Flags();						//Woken tasks with a higher priority preempt us once the request is done
+		break;
+		
+		case CLEAR_F:
+		Kernel_Clear_Flags();
+		break;
+	   
+		case PREEMPT:
+		if(Cp->slice == 0) Dispatch();	//The time slice is used up, so let other tasks of the same priority run
+		break;
+	   
+		case YIELD:
+		case NONE:
+		Dispatch();
+		break;
+       
+		//Invalid request code, just ignore
+		default:
+			err = INVALID_KERNET_REQUEST_ERR;
+		break;
+	}
 
-	//After OS initialization, THIS WILL BE KERNEL'S MAIN LOOP!
-	//NOTE: When another task makes a syscall and enters the loop, it's still in the RUNNING state!
-	while(1) 
+	//The request may have woken up a task that should run instead
+	Kernel_Check_Preempt();
+	Stats_End(request);
+	
+	//NOTE: A task that made a syscall is still in the RUNNING state unless the request changed that!
+	if(Cp == Switched_From)
 	{
 		//Clears the process' request fields
 		Cp->request = NONE;
-		//Cp->request_arg is not reset, because task_sleep uses it to keep track of remaining ticks
-
-		//Load the current task's stack pointer and switch to its context
-		CurrentSp = Cp->sp;
-		Exit_Kernel();
-
-		/* if this task makes a system call, it will return to here! */
-
-		//Save the current task's stack pointer and proceed to handle its request
-		Cp->sp = CurrentSp;
-		
-		//Check if any timer ticks came in
-		Kernel_Tick_Handler();
+		return KEEP_RUNNING;
+	}
+	
+	if(Switched_From->state == DEAD)
+		return SWITCH_DISCARD;
+	return SWITCH_SAVE;
+}
 
-		switch(Cp->request)
-		{
-			case CREATE_T:
-			Kernel_Create_Task(Cp->code, Cp->pri, Cp->arg);
-			break;
-			
-			case TERMINATE:
-			Kernel_Terminate_Task();
-			Dispatch();					//Dispatch is only needed if the syscall requires running a different task  after it's done
-			break;
-		   
-			case SUSPEND:
-			Kernel_Suspend_Task();
-			if(Cp->state != RUNNING) Dispatch();
-			break;
-			
-			case RESUME:
-			Kernel_Resume_Task();
-			Dispatch();
-			break;
-			
-			case SLEEP:
-			Cp->state = SLEEPING;
-			Dispatch();					
-			break;
-			
-			case CREATE_E:
-			Kernel_Create_Event();
-			break;
-			
-			case WAIT_E:
-			Kernel_Wait_Event();	
-			if(Cp->state != RUNNING) Dispatch();	//Don't dispatch to a different task if the event is already siganlled
-			break;
-			
-			case SIGNAL_E:
-			Kernel_Signal_Event();
-			Dispatch();
-			break;
-			
-			case CREATE_M:
-			Kernel_Create_Mutex();
-			break;
-			
-			case LOCK_M:
-			Kernel_Lock_Mutex();
-			//Maybe add a dispatch() here if lock fails?
-			break;
-			
-			case UNLOCK_M:
-			Kernel_Unlock_Mutex();
-			//Does this need dispatch under any circumstances?
-			break;
-		   
-			case YIELD:
-			case NONE:					// NONE could be caused by a timer interrupt
-			Cp->state = READY;
-			Dispatch();
-			break;
-       
-			//Invalid request code, just ignore
-			default:
-				err = INVALID_KERNET_REQUEST_ERR;
-			break;
-       }
-    } 
+/* Called by cswitch.s once the context of the task that entered the kernel has been saved on its stack. Gets the new Cp ready to be restored. */
+void Kernel_Switch_Task()
+{
+	Switched_From->sp = CurrentSp;
+	STATS_COUNT(context_switches);
+	
+	//Load the new task's stack pointer. Its context is restored by cswitch.s.
+	Cp->request = NONE;
+	CurrentSp = Cp->sp;
 }
 
 	
@@ -827,7 +2750,7 @@ void Timer_init()
 	TCCR1B |= (1<<WGM12);
 	TCCR1B &= ~((1<<WGM13)|(1<<WGM11)|(1<<WGM10));
 	
-	OCR1A = TICK_LENG;			//Set timer top comparison value to ~10ms
+	OCR1A = TICK_LENG - 1;		//Set timer top comparison value to 10ms (the counter runs from 0 to OCR1A)
 	TCNT1 = 0;					//Load initial value for timer
 	TIMSK1 |= (1<<OCIE1A);      //enable match for OCR1A interrupt
 	
@@ -843,12 +2766,36 @@ void OS_Init()
 	
 	Task_Count = 0;
 	Event_Count = 0;
+	Sem_Count = 0;
+	MsgQ_Count = 0;
+	Flags_Count = 0;
 	KernelActive = 0;
 	Tick_Count = 0;
-	NextP = 0;
+	Tick_Period = 1;
+	Idle_Ticks = 0;
+	Elapsed_Ticks = 0;
+	Run_Start = 0;
+	Idle_Time = 0;
+	Idle_Window_Mark = 0;
+	Idle_Last_Window = 0;
+	Window_Start = 0;
+	Miss_Handler = NULL;
+	#ifdef EDF_SCHEDULING
+	Edf_Load = 0;
+	#endif
+	ISR_Queue_Head = 0;
+	ISR_Queue_Tail = 0;
+	ISR_Queue_Dropped = 0;
+	Sleep_Queue = NULL;
+	Deadline_Queue = NULL;
+	Kernel_Idle = 0;
+	Ready_Bitmap = 0;
 	Last_PID = 0;
 	Last_EventID = 0;
 	Last_MutexID = 0;
+	Last_SemID = 0;
+	Last_MsgQID = 0;
+	Last_FlagsID = 0;
 	err = NO_ERR;
 	
 	//Clear and initialize the memory used for tasks
@@ -856,6 +2803,12 @@ void OS_Init()
 	for (x = 0; x < MAXTHREAD; x++) {
 		Process[x].state = DEAD;
 	}
+	memset(Ready_Queue, 0, (LOWEST_PRIORITY+1)*sizeof(PD_QUEUE));
+	
+	//The whole stack pool starts out as one free block
+	Free_Stacks = (STACK_BLOCK*)Stack_Pool;
+	Free_Stacks->size = STACK_POOL_SIZE;
+	Free_Stacks->next = NULL;
 	
 	//Clear and initialize the memory used for Events
 	memset(Event, 0, MAXEVENT*sizeof(EVENT_TYPE));
@@ -869,6 +2822,23 @@ void OS_Init()
 		Event[x].id = 0;
 	}
 	
+	//Clear the memory used for semaphores
+	memset(Sem, 0, MAXSEM*sizeof(SEM_TYPE));
+	
+	//Clear the memory used for event flag groups
+	memset(Flags, 0, MAXFLAGS*sizeof(FLAGS_TYPE));
+	
+	//Clear the message queues and put every message buffer into the free pool
+	memset(MsgQ, 0, MAXMSGQ*sizeof(MSGQ_TYPE));
+	Msg_Waiters.head = NULL;
+	Msg_Waiters.tail = NULL;
+	Free_Msgs = NULL;
+	for (x = MSG_POOL_SIZE - 1; x >= 0; x--) {
+		Msg_Pool[x].owner = 0;
+		Msg_Pool[x].next = Free_Msgs;
+		Free_Msgs = &Msg_Pool[x];
+	}
+	
 	#ifdef OS_DEBUG
 	printf("OS initialized!\n");
 	#endif
@@ -892,7 +2862,11 @@ void OS_Start()
 		printf("OS begins!\n");
 		#endif
 		
-		Next_Kernel_Request();
+		//Select an initial task to run and switch to it. The stack we're on becomes the kernel's stack.
+		Dispatch();
+		CurrentSp = Cp->sp;
+		Cp->request = NONE;
+		Exit_Kernel();
 		/* NEVER RETURNS!!! */
 	}
 }
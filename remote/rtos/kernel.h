@@ -13,8 +13,51 @@
 
 //Global configurations
 #define TICK_LENG 625			//The length of a tick = 10ms, using 16Mhz clock and /256 prescsaler
+#define MAX_IDLE_TICKS (0xFFFF / TICK_LENG)	//The most ticks Timer1 can skip in one period while the kernel is idle
 #define MAX_EVENT_SIG_MISS 1	//The maximum number of missed signals to record for an event. 0 = unlimited
+#define MIN_STACK_SIZE 64		//The smallest stack a task can be created with. Must at least hold a full context frame and the initial return addresses.
+#define STACK_PAINT 0xA5		//Every unused stack byte holds this pattern, so the high-water mark of a stack can be measured
+#define STACK_CANARY 0x5C		//Pattern at the limit of every stack. A task whose canary is overwritten has overflowed its stack.
+#define STACK_CANARY_SIZE 2		//Number of canary bytes at the low end of every stack
+#define NO_CEILING 0xFF			//Priority ceiling of a mutex that uses priority inheritance instead
+#define ISR_QUEUE_SIZE 8		//How many requests made by interrupt handlers can be waiting for the kernel. Must be a power of 2.
 #define LOWEST_PRIORITY 10		//The largest number to represent the lowest task priority. 0 will always be the highest priority.
+#define TIME_SLICE {1, 1, 1, 2, 2, 2, 4, 4, 4, 8, 8}	//Ticks a task may run before it's preempted in favour of a task with the same priority, one entry per priority level
+#define UTIL_WINDOW 100			//Length in ticks of the sliding window CPU utilisation is measured over
+#define STATS_BUCKETS 8			//Number of buckets in each request latency histogram
+#define JITTER_BUCKETS 8		//Number of buckets in the release jitter histogram of each periodic task
+#define JITTER_SHIFT 4			//Jitter is counted in units of 2^JITTER_SHIFT Timer1 counts (256us) for its histogram
+//#define EDF_SCHEDULING		//Uncomment to run the periodic tasks of a priority level earliest deadline first, with admission control
+#define EDF_FULL_LOAD 0x8000	//Processor demand of the periodic tasks that takes up the whole CPU, see Kernel_Create_Periodic_Task()
+
+//Kernel statistics (request latencies and scheduler counters) are only kept in debug builds
+#ifndef NDEBUG
+	#define OS_STATS
+#endif
+
+//Every priority level needs its own bit in the ready bitmap
+#if LOWEST_PRIORITY > 15
+	#error "LOWEST_PRIORITY must not exceed 15"
+#endif
+
+//Handles (PID, EVENT, MUTEX) hold the index of the object's table slot in their low bits, and the slot's generation above it
+#define HANDLE_INDEX_BITS 6
+#define HANDLE_INDEX(h) ((h) & ((1 << HANDLE_INDEX_BITS) - 1))
+#define MAKE_HANDLE(gen, index) (((unsigned int)(gen) << HANDLE_INDEX_BITS) | (index))
+
+#if MAXTHREAD > (1 << HANDLE_INDEX_BITS) || MAXEVENT > (1 << HANDLE_INDEX_BITS) || MAXMUTEX > (1 << HANDLE_INDEX_BITS) || MAXSEM > (1 << HANDLE_INDEX_BITS) || MAXMSGQ > (1 << HANDLE_INDEX_BITS) || MAXFLAGS > (1 << HANDLE_INDEX_BITS) || MAXTIMER > (1 << HANDLE_INDEX_BITS)
+	#error "Increase HANDLE_INDEX_BITS to fit every object table"
+#endif
+
+//Context frames built by cswitch.s. These values must match the ones defined there.
+#define LIGHT_FRAME 0			//Frame type of a context saved by a voluntary syscall
+#define FULL_FRAME 1			//Frame type of a context saved by an interrupt
+#define LIGHT_FRAME_REGS 19		//Bytes pushed by SAVECTX_LIGHT: r2-r17, r28, r29 and SREG
+
+//Results of Kernel_Handle_Request. These values must match the ones defined in cswitch.s.
+#define KEEP_RUNNING 0			//Cp keeps running
+#define SWITCH_SAVE 1			//Another task was dispatched, and Cp's context has to be saved first
+#define SWITCH_DISCARD 2		//Another task was dispatched, and Cp is dead, so nothing may be pushed on its stack
 
 //Misc macros
 #define Disable_Interrupt()		asm volatile ("cli"::)
@@ -37,7 +80,19 @@ typedef enum error_codes
 	EVENT_ALREADY_OWNED_ERR,
 	SIGNAL_UNOWNED_EVENT_ERR,
 	MAX_MUTEX_ERR,
-	MUTEX_NOT_FOUND_ERR
+	MUTEX_NOT_FOUND_ERR,
+	OUT_OF_STACK_ERR,
+	STACK_OVERFLOW_ERR,
+	CEILING_VIOLATION_ERR,
+	MAX_SEM_ERR,
+	SEM_NOT_FOUND_ERR,
+	MAX_MSGQ_ERR,
+	MSGQ_NOT_FOUND_ERR,
+	MAX_FLAGS_ERR,
+	FLAGS_NOT_FOUND_ERR,
+	ADMISSION_ERR,
+	MAX_TIMER_ERR,
+	TIMER_NOT_FOUND_ERR
 } ERROR_TYPE;
 
   
@@ -49,7 +104,12 @@ typedef enum process_states
    SUSPENDED,
    SLEEPING,
    WAIT_EVENT,
-   WAIT_MUTEX 
+   WAIT_MUTEX,
+   WAIT_SEM,
+   WAIT_SEND,								//Waiting for room in a full message queue
+   WAIT_RECEIVE,							//Waiting for a message to arrive
+   WAIT_BUFFER,								//Waiting for a message buffer to be freed
+   WAIT_FLAGS
 } PROCESS_STATES;
 
 
@@ -67,30 +127,113 @@ typedef enum kernel_request_type
    SIGNAL_E,
    CREATE_M,							//Initialize a mutex object
    LOCK_M,
-   UNLOCK_M	
+   UNLOCK_M,
+   CREATE_S,							//Initialize a semaphore object
+   WAIT_S,
+   POST_S,
+   CREATE_Q,							//Initialize a message queue
+   SEND_Q,
+   RECEIVE_Q,
+   ALLOC_MSG,							//Take a buffer from the message pool
+   FREE_MSG,
+   CREATE_F,							//Initialize an event flag group
+   WAIT_F,
+   SET_F,
+   CLEAR_F,
+   SLEEP_UNTIL,							//Sleep until an absolute tick
+   NEXT_PERIOD,							//End the current job of a periodic task
+   PREEMPT,								//The running task was interrupted by the timer tick
+   NUM_REQUEST_TYPES					//Not a request: the number of request types above
 } KERNEL_REQUEST_TYPE;
 
 
 /*Process descriptor for a task*/
+/*Flags of the current job of a periodic task*/
+#define JOB_STARTED 1						//The job has been dispatched since its release
+#define JOB_MISSED 2						//The job was still unfinished at its deadline
+
+/*Timing of the jobs of a periodic task. Times are in Timer1 counts (16us each).*/
+typedef struct deadline_stats
+{
+	unsigned int jobs;						//Number of jobs finished
+	unsigned int misses;					//Number of jobs that were unfinished at their deadline
+	unsigned long worst_lateness;			//Longest time a job finished after its deadline
+	unsigned long worst_jitter;				//Longest time from the release of a job until it first got the CPU
+	unsigned int jitter[JITTER_BUCKETS];	//Release to start time, scaled down by JITTER_SHIFT: bucket 0 counts 0, bucket n 2^(n-1) to 2^n - 1, and the last bucket everything longer
+} DEADLINE_STATS;
+
 typedef struct ProcessDescriptor 
 {
-   PID pid;									//An unique process ID for this task.
-   PRIORITY pri;							//The priority of this task, from 0 (highest) to 10 (lowest).
+   PID pid;									//An unique process ID for this task, made from its slot index and generation.
+   unsigned char gen;						//Generation of this slot, bumped every time a task is created in it.
+   PRIORITY pri;							//The priority of this task, from 0 (highest) to 10 (lowest). May be raised by mutex priority inheritance.
+   PRIORITY base_pri;						//The priority this task was created with, i.e. without any inherited priority.
    PROCESS_STATES state;					//What's the current state of this task?
    PROCESS_STATES last_state;				//What's the PREVIOUS state of this task? Used for task suspension/resume.
    KERNEL_REQUEST_TYPE request;				//What the task want the kernel to do (when needed).
    int request_arg;							//What value is needed for the specified kernel request.
+   void *request_data;						//Points to the parameters of a kernel request that needs more than request_arg (e.g. CREATE_T), or to where a CREATE request returns its handle.
    int arg;									//Initial argument for the task (if specified).
    unsigned char *sp;						//stack pointer into the "workSpace".
-   unsigned char workSpace[WORKSPACE];		//Data memory allocated to this process.
+   unsigned char *stack;					//The "workSpace": lowest address of the stack allocated to this process from the stack pool.
+   unsigned int stack_size;					//Size of the stack in bytes.
+   unsigned char slice;						//How many ticks are left in this task's current time slice.
+   unsigned long run_time;					//Total time this task has spent on the CPU, in Timer1 counts (16us each).
+   unsigned long window_mark;				//run_time when the current utilisation window started.
+   unsigned long last_window;				//Time spent on the CPU during the previous utilisation window, in Timer1 counts.
+   TICK wake_delta;							//While in the sleep queue: ticks between the wake-up of the previous sleeper and this task.
+   struct ProcessDescriptor *sleep_next;	//The next task in the sleep queue (if any).
+   TICK request_timeout;					//How many ticks a blocking request may wait before it gives up, 0 = forever.
+   unsigned char timed;						//Set while a waiting task is also in the sleep queue for its timeout.
+   unsigned char wait_status;				//WAIT_OK, or WAIT_TIMEOUT if the last blocking request gave up.
+   TICK period;								//Ticks between the releases of a periodic task, 0 if the task isn't periodic.
+   TICK rel_deadline;						//Ticks from the release of a job until its deadline.
+   TICK wcet;								//Worst case execution time of a job in ticks, as declared by the task.
+   TICK release;							//Tick the current job was released at.
+   TICK deadline;							//Tick the current job has to be done by.
+   unsigned char job_flags;					//JOB_STARTED and JOB_MISSED for the current job.
+   struct ProcessDescriptor *deadline_next;	//The next task in the deadline queue (if any).
+   DEADLINE_STATS timing;					//Deadline misses and release jitter of a periodic task.
    voidfuncptr  code;						//The function to be executed when this process is running.
+   struct ProcessDescriptor *next;			//Next task in the queue this task is currently linked into (if any).
+   struct ProcessDescriptor *prev;			//Previous task in the queue this task is currently linked into (if any).
+   struct mutex_type *blocked_on;			//The mutex this task is waiting for while in the WAIT_MUTEX state.
+   struct mutex_type *owned;				//The mutexes currently locked by this task, linked through their next_owned fields.
 } PD;
 
+/*A FIFO of process descriptors, linked through their next/prev fields. A task can only be in one such queue at a time.*/
+typedef struct pd_queue
+{
+	PD *head;								//The first task in the queue, NULL if empty
+	PD *tail;								//The last task in the queue, NULL if empty
+} PD_QUEUE;
+
+
+/*Parameters of a CREATE_T request, passed through request_data*/
+typedef struct create_args
+{
+	voidfuncptr code;						//The function to be executed by the new task
+	PRIORITY pri;							//Priority of the new task
+	int arg;								//Initial argument for the new task
+	unsigned int stack_size;				//Stack size of the new task in bytes, 0 = WORKSPACE
+	TICK period;							//Ticks between the releases of a periodic task, 0 = not periodic
+	TICK deadline;							//Relative deadline of a periodic task, 0 = its period
+	TICK wcet;								//Worst case execution time of a periodic task
+	PID pid;								//Filled in by the kernel: PID of the new task, 0 if it couldn't be created
+} CREATE_ARGS;
+
+/*Header of a free block in the stack pool, stored inside the free memory itself*/
+typedef struct stack_block
+{
+	unsigned int size;						//Size of this free block in bytes, including the header
+	struct stack_block *next;				//The next free block at a higher address
+} STACK_BLOCK;
 
 //For the ease of manageability, we're making a new event data type. The old EVENT type defined in OS.h will simply serve as an identifier.
 typedef struct event_type
 {
-	EVENT id;								//An unique identifier for this event. 0 = uninitialized
+	EVENT id;								//An unique identifier for this event, made from its slot index and generation. 0 = uninitialized
+	unsigned char gen;						//Generation of this slot, bumped every time an event is created in it.
 	PID owner;								//Who's currently waiting for this event this?
 	unsigned int count;						//How many unhandled events has been collected?
 } EVENT_TYPE;
@@ -98,26 +241,121 @@ typedef struct event_type
 //For the ease of manageability, we're making a new mutex data type. The old MUTEX type defined in OS.h will simply serve as an identifier.
 typedef struct mutex_type
 {
-	MUTEX id;								//unique id for this mutex, 0 = uninitialized
+	MUTEX id;								//unique id for this mutex, made from its slot index and generation. 0 = uninitialized
+	unsigned char gen;						//Generation of this slot, bumped every time a mutex is created in it.
 	PID owner;								//the current owner of the event, 0 = free
 	unsigned int count;						//mutex can be recursively locked
-	PID blocked_stack [MAXTHREAD];			//stack for blocked
-	PRIORITY priority_stack [MAXTHREAD];	//priority of the processes
-	unsigned int order[MAXTHREAD];			//order of task came into the stack
-	unsigned int num_of_process;			//number of processes waiting on the mutex
-	unsigned int total_num;					//total number of process has waitted on this mutex
-	PRIORITY own_pri;						//original priority of the owner
+	PRIORITY ceiling;						//Priority the owner runs at while holding this mutex, NO_CEILING = priority inheritance only
+	PD_QUEUE waiters;						//Tasks blocked on this mutex, highest priority first and in arrival order within a priority
+	struct mutex_type *next_owned;			//The next mutex locked by the same owner (if any)
 } MUTEX_TYPE;
 
 
+/*A counting semaphore*/
+typedef struct sem_type
+{
+	SEMAPHORE id;							//An unique identifier for this semaphore, made from its slot index and generation. 0 = uninitialized
+	unsigned char gen;						//Generation of this slot, bumped every time a semaphore is created in it.
+	unsigned int count;						//Number of units available
+	PD_QUEUE waiters;						//Tasks blocked in Sem_Wait, highest priority first and in arrival order within a priority
+} SEM_TYPE;
+
+
+/*A message buffer. Tasks only see its data, the header is used by the kernel to link it into the free pool or a message queue.*/
+typedef struct msg_buffer
+{
+	struct msg_buffer *next;				//The next buffer in the same list (if any)
+	PID owner;								//The task holding the buffer, 0 while it's free or in a message queue
+	unsigned char data[MSG_SIZE];			//The message itself
+} MSG_BUFFER;
+
+/*A message queue. Messages are passed by handing over their buffer, never copied.*/
+typedef struct msgq_type
+{
+	MSGQ id;								//An unique identifier for this queue, made from its slot index and generation. 0 = uninitialized
+	unsigned char gen;						//Generation of this slot, bumped every time a queue is created in it.
+	unsigned int capacity;					//Most messages the queue holds before senders have to wait
+	unsigned int count;						//Messages currently in the queue
+	MSG_BUFFER *head;						//The oldest message, NULL if empty
+	MSG_BUFFER *tail;						//The newest message, NULL if empty
+	PD_QUEUE senders;						//Tasks waiting for room, highest priority first. Their message is in request_data.
+	PD_QUEUE receivers;						//Tasks waiting for a message, highest priority first
+} MSGQ_TYPE;
+
+
+/*A group of event flags. Unlike an EVENT, it has any number of waiters and isn't consumed.*/
+typedef struct flags_type
+{
+	FLAGS id;								//An unique identifier for this group, made from its slot index and generation. 0 = uninitialized
+	unsigned char gen;						//Generation of this slot, bumped every time a group is created in it.
+	unsigned int flags;						//The flags currently set
+	PD_QUEUE waiters;						//Tasks waiting for flags, highest priority first. Their FLAGS_ARGS are in request_data.
+} FLAGS_TYPE;
+
+/*Parameters of a WAIT_F, SET_F or CLEAR_F request, passed through request_data*/
+typedef struct flags_args
+{
+	unsigned int mask;						//The flags to wait for, set or clear
+	unsigned char mode;						//FLAGS_ANY or FLAGS_ALL, optionally with FLAGS_CLEAR (WAIT_F only)
+	unsigned int result;					//Filled in by the kernel: the flags of mask that were set when the waiter woke up (WAIT_F only)
+} FLAGS_ARGS;
+
+
+/*A request made from an interrupt handler, to be carried out by the kernel on its next entry*/
+typedef struct isr_request
+{
+	KERNEL_REQUEST_TYPE request;			//What the interrupt handler wants the kernel to do
+	int arg;								//What value is needed for the specified kernel request
+} ISR_REQUEST;
+
+
+#ifdef OS_STATS
+/*Latency statistics of one kind of kernel request, in Timer1 counts (16us each)*/
+typedef struct request_stats
+{
+	unsigned int count;						//How many requests of this type have been handled
+	unsigned int min;						//Shortest time taken by one request
+	unsigned int max;						//Longest time taken by one request
+	unsigned int histogram[STATS_BUCKETS];	//Bucket 0 counts requests taking 0, bucket n those taking 2^(n-1) to 2^n - 1, and the last bucket everything longer
+} REQUEST_STATS;
+
+/*Everything the kernel measures about itself*/
+typedef struct kernel_stats
+{
+	REQUEST_STATS request[NUM_REQUEST_TYPES];	//Time spent handling each type of request, not counting the time spent idle
+	unsigned long dispatches;				//Number of times the scheduler picked a task to run
+	unsigned long context_switches;			//Number of times the kernel switched to a different task
+	unsigned long idle_loops;				//Number of times the idle kernel went to sleep waiting for a ready task
+	unsigned long late_tick_isrs;			//Tick interrupts serviced more than half a tick after their compare match. Not a count of lost ticks: Timer1 can't show those.
+} KERNEL_STATS;
+#endif
+
+
 /*Kernel functions accessible by the OS*/
 void OS_Init();
 void OS_Start();
-void Kernel_Create_Task(voidfuncptr f, PRIORITY py, int arg);
+PID Kernel_Create_Task(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size);
+PID Kernel_Create_Periodic_Task(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size, TICK period, TICK deadline, TICK wcet);
 void Kernel_Create_Event();
-void Kernel_Create_Mutex();
-int findPIDByFuncPtr(voidfuncptr f);
+void Kernel_Create_Mutex(PRIORITY ceiling);
+void Kernel_Create_Sem(unsigned int count);
+void Kernel_Create_MsgQ(unsigned int capacity);
+void Kernel_Create_Flags();
+void Kernel_Request_FromISR(KERNEL_REQUEST_TYPE request, int arg);
+PID findPIDByFuncPtr(voidfuncptr f);
 int getEventCount(EVENT e);
+unsigned int getStackHighWater(PID pid);
+unsigned long getTaskRunTime(PID pid);
+unsigned char getTaskUtilisation(PID pid);
+unsigned char getIdleUtilisation();
+unsigned char getDeadlineStats(PID pid, DEADLINE_STATS *stats);
+void resetDeadlineStats(PID pid);
+void setDeadlineMissHandler(missfuncptr f);
+TICK getTicks();
+#ifdef OS_STATS
+void getKernelStats(KERNEL_STATS *stats);
+void resetKernelStats();
+#endif
 
 /*Kernel variables accessible by the OS*/
 extern volatile PD* Cp;
@@ -128,6 +366,10 @@ extern volatile ERROR_TYPE err;
 extern volatile unsigned int Last_PID;
 extern volatile unsigned int Last_EventID;
 extern volatile unsigned int Last_MutexID;
+extern volatile unsigned int Last_SemID;
+extern volatile unsigned int Last_MsgQID;
+extern volatile unsigned int Last_FlagsID;
+extern volatile unsigned long Idle_Ticks;
 
 
 #endif /* KERNEL_H_ */
\ No newline at end of file
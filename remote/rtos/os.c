@@ -11,34 +11,64 @@ extern void a_main();					//External entry point for application once kernel and
 /*						   RTOS API FUNCTIONS                           */
 /************************************************************************/
 
-/* OS call to create a new task */
-PID Task_Create(voidfuncptr f, PRIORITY py, int arg)
+/* OS call to create a new task with a stack of stack_size bytes taken from the stack pool (0 = WORKSPACE) */
+PID Task_Create(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size)
 {
+   CREATE_ARGS args;
+   
    //Run the task creation through kernel if it's running already
    if (KernelActive) 
    {
      Disable_Interrupt();
 	 
-	 //Fill in the parameters for the new task into CP
-	 Cp->pri = py;
-	 Cp->arg = arg;
+	 //Fill in the parameters for the new task. They are passed on the caller's stack, so Cp's own fields are left alone
+	 args.code = f;
+	 args.pri = py;
+	 args.arg = arg;
+	 args.stack_size = stack_size;
+	 args.period = 0;
      Cp->request = CREATE_T;
-     Cp->code = f;
+     Cp->request_data = &args;
 
      Enter_Kernel();
    } 
    else 
-	   Kernel_Create_Task(f,py,arg);		//If kernel hasn't started yet, manually create the task
-   
-   //Return zero as PID if the task creation process gave errors. Note that the smallest valid PID is 1
-   if (err == MAX_PROCESS_ERR)
-		return 0;
+	   args.pid = Kernel_Create_Task(f,py,arg,stack_size);		//If kernel hasn't started yet, manually create the task
    
+   //Zero is returned as PID if the task creation process gave errors. Note that a valid PID is never 0
    #ifdef OS_DEBUG
-	printf("Created PID: %d\n", Last_PID);
+   if (args.pid != 0)
+	printf("Created PID: %d\n", args.pid);
    #endif
    
-   return Last_PID;
+   return args.pid;
+}
+
+/* OS call to create a periodic task, released right away and then every period ticks. See Kernel_Create_Periodic_Task(). */
+PID Task_Create_Periodic(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size, TICK period, TICK deadline, TICK wcet)
+{
+	CREATE_ARGS args;
+	
+	if (KernelActive)
+	{
+		Disable_Interrupt();
+		
+		args.code = f;
+		args.pri = py;
+		args.arg = arg;
+		args.stack_size = stack_size;
+		args.period = period;
+		args.deadline = deadline;
+		args.wcet = wcet;
+		Cp->request = CREATE_T;
+		Cp->request_data = &args;
+		
+		Enter_Kernel();
+	}
+	else
+		args.pid = Kernel_Create_Periodic_Task(f, py, arg, stack_size, period, deadline, wcet);
+	
+	return args.pid;
 }
 
 /* The calling task terminates itself. */
@@ -75,6 +105,22 @@ int Task_GetArg()
 		return -1;
 }
 
+/*Returns the high-water mark of a task's stack in bytes. Doesn't enter the kernel, so it can be polled without disturbing the schedule.*/
+unsigned int Task_GetStackUsage(PID p)
+{
+	return getStackHighWater(p);
+}
+
+unsigned long Task_GetRunTime(PID p)
+{
+	return getTaskRunTime(p);
+}
+
+unsigned char Task_GetCpuUsage(PID p)
+{
+	return getTaskUtilisation(p);
+}
+
 void Task_Suspend(PID p)
 {
 	if(!KernelActive){
@@ -120,42 +166,124 @@ void Task_Sleep(TICK t)
 	Enter_Kernel();
 }
 
+/*Returns how many jobs of a periodic task missed their deadline, 0 if the PID is invalid. More is available from getDeadlineStats().*/
+unsigned int Task_GetDeadlineMisses(PID p)
+{
+	DEADLINE_STATS stats;
+	
+	if(!getDeadlineStats(p, &stats))
+		return 0;
+	
+	return stats.misses;
+}
+
+/*Sets the function called whenever a periodic job misses its deadline. It runs inside the kernel, so it has to be short.*/
+void OS_SetDeadlineMissHandler(missfuncptr f)
+{
+	setDeadlineMissHandler(f);
+}
+
+/*Ends the current job of a periodic task and sleeps until its next release*/
+void Task_Next_Period(void)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = NEXT_PERIOD;
+	Enter_Kernel();
+}
+
+/*Puts the calling task to sleep until the tick count (see OS_GetTicks) reaches t. Returns right away if t has already passed.*/
+void Task_Sleep_Until(TICK t)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = SLEEP_UNTIL;
+	Cp->request_arg = t;
+	Enter_Kernel();
+}
+
+/*Returns the number of ticks since OS_Start(). It wraps around, so only compare two tick counts through their difference.*/
+TICK OS_GetTicks(void)
+{
+	return getTicks();
+}
+
+/*Returns how many ticks the kernel has spent idle (sleeping) since OS_Init*/
+unsigned long OS_GetIdleTicks(void)
+{
+	unsigned long ticks;
+	unsigned char sreg = SREG;
+	
+	//The counter is updated by the kernel, so read it in one piece
+	Disable_Interrupt();
+	ticks = Idle_Ticks;
+	SREG = sreg;
+	
+	return ticks;
+}
+
+/*Returns the percentage of the last UTIL_WINDOW ticks the kernel has spent idle*/
+unsigned char OS_GetIdlePercent(void)
+{
+	return getIdleUtilisation();
+}
+
 /*Initialize an event object*/
 EVENT Event_Init(void)
 {
+	EVENT e;
+	
+	//The kernel returns the new handle through request_data, or zero if the event creation process gave errors. Note that the smallest valid event ID is 1
 	if(KernelActive)
 	{
 		Disable_Interrupt();
 		Cp->request = CREATE_E;
+		Cp->request_data = &e;
 		Enter_Kernel();
 	}
 	else
+	{
 		Kernel_Create_Event();	//Call the kernel function directly if kernel has not started yet.
-	
-	
-	//Return zero as Event ID if the event creation process gave errors. Note that the smallest valid event ID is 1
-	if (err == MAX_EVENT_ERR)
-		return 0;
+		e = (err == NO_ERR) ? Last_EventID : 0;
+	}
 	
 	#ifdef OS_DEBUG
-	printf("Created Event: %d\n", Last_EventID);
+	if (e != 0)
+		printf("Created Event: %d\n", e);
 	#endif
 	
-	return Last_EventID;
+	return e;
 }
 
 void Event_Wait(EVENT e)
+{
+	Event_Wait_Timeout(e, WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for an event. Returns WAIT_TIMEOUT if it wasn't signalled in time, and the event is left unowned.*/
+unsigned char Event_Wait_Timeout(EVENT e, TICK t)
 {
 	if(!KernelActive){
 		err = KERNEL_INACTIVE_ERR;
-		return;
+		return WAIT_OK;
 	}
 	Disable_Interrupt();
 	
 	Cp->request = WAIT_E;
 	Cp->request_arg = e;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
 	Enter_Kernel();
 	
+	return Cp->wait_status;
 }
 
 void Event_Signal(EVENT e)
@@ -171,40 +299,75 @@ void Event_Signal(EVENT e)
 	Enter_Kernel();	
 }
 
-MUTEX Mutex_Init(void)
+/*Signals an event from an interrupt handler. The owner is woken up on the next kernel entry, at most one tick later.*/
+void Event_Signal_FromISR(EVENT e)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	
+	Kernel_Request_FromISR(SIGNAL_E, e);
+}
+
+static MUTEX Mutex_Create(PRIORITY ceiling)
 {
+	MUTEX m;
+	
+	//The kernel returns the new handle through request_data, or zero if the mutex creation process gave errors. Note that the smallest valid mutex ID is 1
 	if(KernelActive)
 	{
 		Disable_Interrupt();
 		Cp->request = CREATE_M;
+		Cp->request_arg = ceiling;
+		Cp->request_data = &m;
 		Enter_Kernel();
 	}
 	else
-		Kernel_Create_Mutex();	//Call the kernel function directly if OS hasn't start yet
-	
-	
-	//Return zero as Mutex ID if the mutex creation process gave errors. Note that the smallest valid mutex ID is 1
-	if (err == MAX_MUTEX_ERR)
-	return 0;
+	{
+		Kernel_Create_Mutex(ceiling);	//Call the kernel function directly if OS hasn't start yet
+		m = (err == NO_ERR) ? Last_MutexID : 0;
+	}
 	
 	#ifdef OS_DEBUG
-	printf("Created Mutex: %d\n", Last_MutexID);
+	if (m != 0)
+		printf("Created Mutex: %d\n", m);
 	#endif
 	
-	return Last_MutexID;
+	return m;
+}
+
+MUTEX Mutex_Init(void)
+{
+	return Mutex_Create(NO_CEILING);
+}
+
+MUTEX Mutex_Init_Ceiling(PRIORITY ceiling)
+{
+	return Mutex_Create(ceiling);
 }
 
 void Mutex_Lock(MUTEX m)
+{
+	Mutex_Lock_Timeout(m, WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for a mutex. Returns WAIT_TIMEOUT if it couldn't be locked in time, and the owner stops inheriting our priority.*/
+unsigned char Mutex_Lock_Timeout(MUTEX m, TICK t)
 {
 	if(!KernelActive){
 		err = KERNEL_INACTIVE_ERR;
-		return;
+		return WAIT_OK;
 	}
 	Disable_Interrupt();
 	
 	Cp->request = LOCK_M;
 	Cp->request_arg = m;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
 	Enter_Kernel();
+	
+	return Cp->wait_status;
 }
 
 void Mutex_Unlock(MUTEX m)
@@ -220,6 +383,269 @@ void Mutex_Unlock(MUTEX m)
 	Enter_Kernel();
 }
 
+/*Initialize a counting semaphore holding count units*/
+SEMAPHORE Sem_Init(unsigned int count)
+{
+	SEMAPHORE s;
+	
+	//The kernel returns the new handle through request_data, or zero if the creation process gave errors. Note that the smallest valid semaphore ID is 1
+	if(KernelActive)
+	{
+		Disable_Interrupt();
+		Cp->request = CREATE_S;
+		Cp->request_arg = count;
+		Cp->request_data = &s;
+		Enter_Kernel();
+	}
+	else
+	{
+		Kernel_Create_Sem(count);	//Call the kernel function directly if kernel has not started yet.
+		s = (err == NO_ERR) ? Last_SemID : 0;
+	}
+	
+	return s;
+}
+
+void Sem_Wait(SEMAPHORE s)
+{
+	Sem_Wait_Timeout(s, WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for a unit. Returns WAIT_TIMEOUT if none was posted in time.*/
+unsigned char Sem_Wait_Timeout(SEMAPHORE s, TICK t)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return WAIT_OK;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = WAIT_S;
+	Cp->request_arg = s;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
+	Enter_Kernel();
+	
+	return Cp->wait_status;
+}
+
+void Sem_Post(SEMAPHORE s)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = POST_S;
+	Cp->request_arg = s;
+	Enter_Kernel();
+}
+
+/*Posts a semaphore from an interrupt handler. A waiter is woken up on the next kernel entry, at most one tick later.*/
+void Sem_Post_FromISR(SEMAPHORE s)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	
+	Kernel_Request_FromISR(POST_S, s);
+}
+
+/*Initialize a message queue that holds up to capacity messages*/
+MSGQ MsgQ_Init(unsigned int capacity)
+{
+	MSGQ q;
+	
+	//The kernel returns the new handle through request_data, or zero if the creation process gave errors. Note that the smallest valid queue ID is 1
+	if(KernelActive)
+	{
+		Disable_Interrupt();
+		Cp->request = CREATE_Q;
+		Cp->request_arg = capacity;
+		Cp->request_data = &q;
+		Enter_Kernel();
+	}
+	else
+	{
+		Kernel_Create_MsgQ(capacity);	//Call the kernel function directly if kernel has not started yet.
+		q = (err == NO_ERR) ? Last_MsgQID : 0;
+	}
+	
+	return q;
+}
+
+void* Msg_Alloc(void)
+{
+	return Msg_Alloc_Timeout(WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for a free buffer. Returns NULL if none was freed in time.*/
+void* Msg_Alloc_Timeout(TICK t)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return NULL;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = ALLOC_MSG;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
+	Enter_Kernel();
+	
+	//The kernel leaves the buffer in request_data, whether one was free or we had to wait for it. It stays NULL on a timeout.
+	return Cp->request_data;
+}
+
+void Msg_Free(void *msg)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = FREE_MSG;
+	Cp->request_data = msg;
+	Enter_Kernel();
+}
+
+void MsgQ_Send(MSGQ q, void *msg)
+{
+	MsgQ_Send_Timeout(q, msg, WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for room in a queue. Returns WAIT_TIMEOUT if there was none in time, and the caller still owns msg.*/
+unsigned char MsgQ_Send_Timeout(MSGQ q, void *msg, TICK t)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return WAIT_OK;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = SEND_Q;
+	Cp->request_arg = q;
+	Cp->request_data = msg;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
+	Enter_Kernel();
+	
+	return Cp->wait_status;
+}
+
+void* MsgQ_Receive(MSGQ q)
+{
+	return MsgQ_Receive_Timeout(q, WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for a message. Returns NULL if none arrived in time.*/
+void* MsgQ_Receive_Timeout(MSGQ q, TICK t)
+{
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return NULL;
+	}
+	Disable_Interrupt();
+	
+	Cp->request = RECEIVE_Q;
+	Cp->request_arg = q;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
+	Enter_Kernel();
+	
+	//The kernel leaves the message in request_data, whether one was queued or we had to wait for it. It stays NULL on a timeout.
+	return Cp->request_data;
+}
+
+/*Initialize a group of event flags, all clear*/
+FLAGS Flags_Init(void)
+{
+	FLAGS f;
+	
+	//The kernel returns the new handle through request_data, or zero if the creation process gave errors. Note that the smallest valid group ID is 1
+	if(KernelActive)
+	{
+		Disable_Interrupt();
+		Cp->request = CREATE_F;
+		Cp->request_data = &f;
+		Enter_Kernel();
+	}
+	else
+	{
+		Kernel_Create_Flags();	//Call the kernel function directly if kernel has not started yet.
+		f = (err == NO_ERR) ? Last_FlagsID : 0;
+	}
+	
+	return f;
+}
+
+unsigned int Flags_Wait(FLAGS f, unsigned int mask, unsigned char mode)
+{
+	return Flags_Wait_Timeout(f, mask, mode, WAIT_FOREVER);
+}
+
+/*Waits at most t ticks for the flags. Returns 0 if the condition wasn't met in time.*/
+unsigned int Flags_Wait_Timeout(FLAGS f, unsigned int mask, unsigned char mode, TICK t)
+{
+	FLAGS_ARGS args;
+	
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return 0;
+	}
+	Disable_Interrupt();
+	
+	//The parameters stay on our stack while we wait, the kernel writes the result there when it wakes us up
+	args.mask = mask;
+	args.mode = mode;
+	args.result = 0;
+	Cp->request = WAIT_F;
+	Cp->request_arg = f;
+	Cp->request_data = &args;
+	Cp->request_timeout = t;
+	Cp->wait_status = WAIT_OK;
+	Enter_Kernel();
+	
+	return args.result;
+}
+
+void Flags_Set(FLAGS f, unsigned int bits)
+{
+	FLAGS_ARGS args;
+	
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	Disable_Interrupt();
+	
+	args.mask = bits;
+	Cp->request = SET_F;
+	Cp->request_arg = f;
+	Cp->request_data = &args;
+	Enter_Kernel();
+}
+
+void Flags_Clear(FLAGS f, unsigned int bits)
+{
+	FLAGS_ARGS args;
+	
+	if(!KernelActive){
+		err = KERNEL_INACTIVE_ERR;
+		return;
+	}
+	Disable_Interrupt();
+	
+	args.mask = bits;
+	Cp->request = CLEAR_F;
+	Cp->request_arg = f;
+	Cp->request_data = &args;
+	Enter_Kernel();
+}
+
 /*Don't use main function for application code. Any mandatory kernel initialization should be done here*/
 
 void main() 
@@ -8,9 +8,16 @@
 #define _OS_H_  
    
 #define MAXTHREAD     16       
-#define WORKSPACE     256   // in bytes, per THREAD
+#define WORKSPACE     256   // default stack size in bytes, per THREAD
+#define STACK_POOL_SIZE 2048 // in bytes, shared by the stacks of all THREADs
 #define MAXMUTEX      8 
 #define MAXEVENT      8      
+#define MAXSEM        8
+#define MAXMSGQ       4
+#define MAXFLAGS      4
+#define MAXTIMER      16
+#define MSG_SIZE      8     // size in bytes of every message buffer
+#define MSG_POOL_SIZE 8     // number of message buffers, shared by all message queues
 #define MSECPERTICK   10   // resolution of a system tick in milliseconds
 #define MINPRIORITY   10   // 0 is the highest priority, 10 the lowest
 
@@ -25,26 +32,91 @@ typedef unsigned int MUTEX;      // always non-zero if it is valid
 typedef unsigned char PRIORITY;
 typedef unsigned int EVENT;      // always non-zero if it is valid
 typedef unsigned int TICK;
+typedef unsigned int SEMAPHORE;  // always non-zero if it is valid
+typedef unsigned int MSGQ;       // always non-zero if it is valid
+typedef unsigned int FLAGS;      // always non-zero if it is valid
+typedef void (*missfuncptr) (PID);   /* pointer to void f(PID), see OS_SetDeadlineMissHandler */
+typedef unsigned int TIMER;      // always non-zero if it is valid
+typedef void (*timerfuncptr) (int);      /* pointer to void f(int), the callback of a timer */
+
+// modes of Flags_Wait, FLAGS_CLEAR may be combined with either of the others
+#define FLAGS_ANY     0     // wake up once any flag of the mask is set
+#define FLAGS_ALL     1     // wake up once every flag of the mask is set
+#define FLAGS_CLEAR   2     // clear the flags that woke us up
+
+// modes of Timer_Create
+#define TIMER_ONE_SHOT     0     // expires once per Timer_Start
+#define TIMER_AUTO_RELOAD  1     // keeps expiring every period until stopped
+
+// timeouts of the blocking calls, in ticks
+#define WAIT_FOREVER  0     // never give up
+
+// results of the blocking calls with a timeout
+#define WAIT_OK       0     // got what it waited for (or didn't have to wait)
+#define WAIT_TIMEOUT  1     // gave up after the timeout, nothing was taken
 
 // void OS_Init(void);      redefined as main()
 void OS_Abort(void);
 
 //PID  Task_Create( void (*f)(void), PRIORITY py, int arg);
-PID  Task_Create(voidfuncptr f, PRIORITY py, int arg);
+PID  Task_Create(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size);   // stack_size 0 = WORKSPACE
+PID  Task_Create_Periodic(voidfuncptr f, PRIORITY py, int arg, unsigned int stack_size, TICK period, TICK deadline, TICK wcet);   // deadline 0 = period
+void Task_Next_Period(void);   // a periodic task calls this at the end of every job
+unsigned int Task_GetDeadlineMisses(PID p);   // number of jobs of periodic task p that missed their deadline
+void OS_SetDeadlineMissHandler(missfuncptr f);   // f(pid) is called by the kernel on every miss, with interrupts off; it may only use the _FromISR calls
 void Task_Terminate(void);
 void Task_Yield(void);
 int  Task_GetArg(void);
+unsigned int Task_GetStackUsage(PID p);   // the most bytes of its stack task p has used so far
+unsigned long Task_GetRunTime(PID p);     // total time task p has run, in units of 16 microseconds
+unsigned char Task_GetCpuUsage(PID p);    // percentage of the CPU task p used over the last second or so
 void Task_Suspend( PID p );          
 void Task_Resume( PID p );
 
 void Task_Sleep(TICK t);  // sleep time is at least t*MSECPERTICK
+void Task_Sleep_Until(TICK t);  // sleeps until OS_GetTicks() reaches t; add the period to t on every loop for a drift-free periodic task
+TICK OS_GetTicks(void);   // ticks since OS_Start(), wraps around
 
 MUTEX Mutex_Init(void);
+MUTEX Mutex_Init_Ceiling(PRIORITY ceiling);   // the owner runs at the ceiling priority; no task with a higher priority may lock it
 void Mutex_Lock(MUTEX m);
+unsigned char Mutex_Lock_Timeout(MUTEX m, TICK t);   // the Xxx_Timeout calls give up after t ticks (WAIT_FOREVER = never)
 void Mutex_Unlock(MUTEX m);
 
+unsigned long OS_GetIdleTicks(void);	// number of ticks the CPU has spent sleeping with no task ready
+unsigned char OS_GetIdlePercent(void);	// percentage of the CPU left idle over the last second or so
+
 EVENT Event_Init(void);
 void Event_Wait(EVENT e);
+unsigned char Event_Wait_Timeout(EVENT e, TICK t);
 void Event_Signal(EVENT e);
+void Event_Signal_FromISR(EVENT e);   // only this one may be called from an interrupt handler
+
+SEMAPHORE Sem_Init(unsigned int count);   // count = number of units initially available
+void Sem_Wait(SEMAPHORE s);               // takes a unit, blocking until one is posted if none is left
+unsigned char Sem_Wait_Timeout(SEMAPHORE s, TICK t);
+void Sem_Post(SEMAPHORE s);               // gives a unit back, waking the highest priority waiter
+void Sem_Post_FromISR(SEMAPHORE s);       // only this one may be called from an interrupt handler
+
+MSGQ MsgQ_Init(unsigned int capacity);    // capacity = messages the queue holds before senders block, at least 1
+void* Msg_Alloc(void);                    // takes a MSG_SIZE byte buffer from the pool, blocking until one is free
+void* Msg_Alloc_Timeout(TICK t);          // NULL on a timeout
+void Msg_Free(void *msg);                 // gives a buffer the caller holds back to the pool; anything else is ignored
+void MsgQ_Send(MSGQ q, void *msg);        // passes the buffer (not a copy) to q, blocking while q is full; only the holder can send it
+unsigned char MsgQ_Send_Timeout(MSGQ q, void *msg, TICK t);   // on a timeout the caller still owns msg
+void* MsgQ_Receive(MSGQ q);               // blocks until a message arrives; the caller then owns it and must Msg_Free it
+void* MsgQ_Receive_Timeout(MSGQ q, TICK t);   // NULL on a timeout
+
+FLAGS Flags_Init(void);                   // a group of 16 event flags, all clear. It lasts until the system stops.
+unsigned int Flags_Wait(FLAGS f, unsigned int mask, unsigned char mode);   // returns the flags of mask that were set when it woke up
+unsigned int Flags_Wait_Timeout(FLAGS f, unsigned int mask, unsigned char mode, TICK t);   // 0 on a timeout
+void Flags_Set(FLAGS f, unsigned int bits);      // wakes every waiter whose condition is now met, highest priority first
+void Flags_Clear(FLAGS f, unsigned int bits);
+
+// timer callbacks run one after the other in the timer service task, so they must not block for long
+TIMER Timer_Create(timerfuncptr f, int arg, TICK period, unsigned char mode);   // created stopped; f(arg) is called period ticks after Timer_Start
+void Timer_Start(TIMER t);                // (re)starts t from now. Not from an interrupt handler.
+void Timer_Stop(TIMER t);
+void Timer_Delete(TIMER t);
 
 #endif /* _OS_H_ */
@@ -0,0 +1,324 @@
+#include "kernel.h"
+#include "timer.h"
+
+/*Timer variables. They are shared by the timer service task and every task using a timer, so they are only touched with interrupts disabled.*/
+volatile static TIMER_TYPE Timer[MAXTIMER];			//Contains all the timer objects
+static TIMER_TYPE *Wheel[TIMER_WHEEL_SIZE];			//Running timers, by the slot of their expiry tick
+static TIMER_TYPE *Pending;							//Expired timers whose callbacks haven't been called yet
+volatile static unsigned int Timer_Count;			//Number of timers created so far
+volatile static unsigned int Running_Timers;		//Number of timers linked into the wheel
+volatile static TICK Wheel_Tick;					//The last tick whose slot the service task has handled
+volatile static TICK Wake_Tick;						//The tick the service task is going to wake up at
+volatile static unsigned char Wake_Set;				//0 if the service task waits until a timer is started
+static SEMAPHORE Timer_Wakeup;						//Posted to wake the service task before Wake_Tick
+static PID Timer_Service_PID;						//The timer service task, 0 until the first timer is created
+
+/************************************************************************/
+/*						   TIMER WHEEL HELPERS                          */
+/************************************************************************/
+
+/*Returns the pointer of a timer by looking up the slot its handle refers to*/
+static TIMER_TYPE* findTimerByTimerID(TIMER t)
+{
+	int i;
+	
+	if(t == 0)
+	{
+		err = INVALID_ARG_ERR;
+		return NULL;
+	}
+	
+	i = HANDLE_INDEX(t);
+	if(i < MAXTIMER && Timer[i].id == t)
+		return (TIMER_TYPE*)&Timer[i];
+	
+	err = TIMER_NOT_FOUND_ERR;
+	return NULL;
+}
+
+/*Adds a timer at the head of a list*/
+static void Timer_Push(TIMER_TYPE **list, TIMER_TYPE *t)
+{
+	t->prev = NULL;
+	t->next = *list;
+	if(*list != NULL)
+		(*list)->prev = t;
+	*list = t;
+}
+
+/*Links a timer into the wheel slot of its expiry tick*/
+static void Timer_Link(TIMER_TYPE *t)
+{
+	t->slot = t->expiry & (TIMER_WHEEL_SIZE - 1);
+	Timer_Push(&Wheel[t->slot], t);
+	++Running_Timers;
+}
+
+/*Takes a timer out of the wheel or the pending list, leaving it stopped*/
+static void Timer_Unlink(TIMER_TYPE *t)
+{
+	if(t->prev != NULL)
+		t->prev->next = t->next;
+	else if(t->slot == TIMER_PENDING)
+		Pending = t->next;
+	else
+		Wheel[t->slot] = t->next;
+	
+	if(t->next != NULL)
+		t->next->prev = t->prev;
+	
+	if(t->slot != TIMER_PENDING)
+		--Running_Timers;
+	t->next = NULL;
+	t->prev = NULL;
+	t->slot = TIMER_STOPPED;
+}
+
+/*Moves the timers expiring at a tick from its wheel slot to the pending list. The slot also holds timers for later turns of the wheel, which stay.*/
+static void Timer_Expire_Slot(TICK tick)
+{
+	TIMER_TYPE *t = Wheel[tick & (TIMER_WHEEL_SIZE - 1)];
+	TIMER_TYPE *next;
+	
+	for(; t != NULL; t = next)
+	{
+		next = t->next;
+		if(t->expiry != tick)
+			continue;
+	
+		Timer_Unlink(t);
+		t->slot = TIMER_PENDING;
+		Timer_Push(&Pending, t);
+	}
+}
+
+/*Calls the callbacks of the pending timers, restarting the auto-reload ones first so a callback may stop or restart its own timer*/
+static void Timer_Run_Pending()
+{
+	TIMER_TYPE *t;
+	timerfuncptr f;
+	int arg;
+	unsigned char sreg;
+	
+	while(1)
+	{
+		sreg = SREG;
+		Disable_Interrupt();
+		t = Pending;
+		if(t == NULL)
+		{
+			SREG = sreg;
+			return;
+		}
+	
+		Timer_Unlink(t);
+		if(t->mode == TIMER_AUTO_RELOAD)
+		{
+			//The next expiry is taken from the last one, not from now, so the period doesn't drift. Expiries the service task was too late for are skipped.
+			do
+				t->expiry += t->period;
+			while((int)(t->expiry - Wheel_Tick) <= 0);
+			Timer_Link(t);
+		}
+		f = t->callback;
+		arg = t->arg;
+		SREG = sreg;
+	
+		f(arg);
+	}
+}
+
+/*
+ * Finds out how long the service task may sleep: until the next wheel slot that isn't empty, at most one turn of the wheel away.
+ * Returns 0 if no timer is running, in which case it sleeps until one is started. The wait may be 0 or less if the task is behind.
+ */
+static unsigned char Timer_Next_Wake(int *wait)
+{
+	unsigned char sreg = SREG;
+	unsigned char i;
+	
+	Disable_Interrupt();
+	if(Running_Timers == 0)
+		Wake_Set = 0;
+	else
+	{
+		for(i = 1; i < TIMER_WHEEL_SIZE && Wheel[(TICK)(Wheel_Tick + i) & (TIMER_WHEEL_SIZE - 1)] == NULL; i++);
+		Wake_Tick = Wheel_Tick + i;
+		Wake_Set = 1;
+		*wait = (int)(Wake_Tick - OS_GetTicks());
+	}
+	SREG = sreg;
+	
+	return Wake_Set;
+}
+
+/*The timer service task. It handles the wheel slot of every tick that has passed, calls the callbacks of the timers that expired, and sleeps until the next slot with a timer in it.*/
+static void Timer_Service()
+{
+	TICK now;
+	int wait;
+	unsigned char sreg;
+	
+	while(1)
+	{
+		now = OS_GetTicks();
+		while((int)(now - Wheel_Tick) > 0)
+		{
+			sreg = SREG;
+			Disable_Interrupt();
+	
+			//Nothing is running, so there's nothing to catch up on
+			if(Running_Timers == 0)
+				Wheel_Tick = now;
+			else
+				Timer_Expire_Slot(++Wheel_Tick);
+			SREG = sreg;
+	
+			Timer_Run_Pending();
+		}
+	
+		if(!Timer_Next_Wake(&wait))
+			Sem_Wait(Timer_Wakeup);
+		else if(wait > 0)
+			Sem_Wait_Timeout(Timer_Wakeup, wait);
+	}
+}
+
+/************************************************************************/
+/*						   TIMER API FUNCTIONS                          */
+/************************************************************************/
+
+/*
+ * Creates a stopped timer that calls f(arg) from the timer service task period ticks after it's started.
+ * A TIMER_AUTO_RELOAD timer then keeps expiring every period ticks until it's stopped.
+ * The service task is created along with the first timer.
+ */
+TIMER Timer_Create(timerfuncptr f, int arg, TICK period, unsigned char mode)
+{
+	unsigned char sreg;
+	TIMER_TYPE *t;
+	int i;
+	
+	if(f == NULL || period == 0 || (mode != TIMER_ONE_SHOT && mode != TIMER_AUTO_RELOAD))
+	{
+		#ifdef OS_DEBUG
+		printf("Timer_Create: Invalid callback, period or mode!\n");
+		#endif
+		err = INVALID_ARG_ERR;
+		return 0;
+	}
+	
+	if(Timer_Wakeup == 0 && (Timer_Wakeup = Sem_Init(0)) == 0)
+		return 0;
+	if(Timer_Service_PID == 0 && (Timer_Service_PID = Task_Create(Timer_Service, TIMER_PRIORITY, 0, TIMER_STACK_SIZE)) == 0)
+		return 0;
+	
+	sreg = SREG;
+	Disable_Interrupt();
+	
+	//Make sure the system's timers are not at max
+	if(Timer_Count >= MAXTIMER)
+	{
+		SREG = sreg;
+		#ifdef OS_DEBUG
+		printf("Timer_Create: Failed to create timer. The system is at its max timer threshold.\n");
+		#endif
+		err = MAX_TIMER_ERR;
+		return 0;
+	}
+	
+	//Find an uninitialized timer slot, and assign a new handle to it. Note that a valid timer ID is never 0.
+	for(i=0; i<MAXTIMER; i++)
+		if(Timer[i].id == 0) break;
+	
+	t = (TIMER_TYPE*)&Timer[i];
+	if(++(t->gen) == 0)
+		t->gen = 1;
+	t->id = MAKE_HANDLE(t->gen, i);
+	t->mode = mode;
+	t->slot = TIMER_STOPPED;
+	t->callback = f;
+	t->arg = arg;
+	t->period = period;
+	t->next = NULL;
+	t->prev = NULL;
+	++Timer_Count;
+	err = NO_ERR;
+	SREG = sreg;
+	
+	return t->id;
+}
+
+/*Starts a timer, so it expires period ticks from now. A running timer is restarted.*/
+void Timer_Start(TIMER id)
+{
+	unsigned char sreg = SREG;
+	unsigned char wake = 0;
+	TIMER_TYPE *t;
+	
+	Disable_Interrupt();
+	t = findTimerByTimerID(id);
+	if(t == NULL)
+	{
+		SREG = sreg;
+		return;
+	}
+	
+	if(t->slot != TIMER_STOPPED)
+		Timer_Unlink(t);
+	
+	//An empty wheel may have been left behind by the service task, so it starts again from now
+	if(Running_Timers == 0)
+		Wheel_Tick = OS_GetTicks();
+	t->expiry = OS_GetTicks() + t->period;
+	Timer_Link(t);
+	
+	//Wake the service task if it would otherwise sleep past the new expiry
+	if(!Wake_Set || (int)(t->expiry - Wake_Tick) < 0)
+	{
+		Wake_Tick = t->expiry;
+		Wake_Set = 1;
+		wake = 1;
+	}
+	err = NO_ERR;
+	SREG = sreg;
+	
+	if(wake && KernelActive)
+		Sem_Post(Timer_Wakeup);
+}
+
+/*Stops a timer. Its callback isn't called any more, even if it has just expired.*/
+void Timer_Stop(TIMER id)
+{
+	unsigned char sreg = SREG;
+	TIMER_TYPE *t;
+	
+	Disable_Interrupt();
+	t = findTimerByTimerID(id);
+	if(t != NULL)
+	{
+		if(t->slot != TIMER_STOPPED)
+			Timer_Unlink(t);
+		err = NO_ERR;
+	}
+	SREG = sreg;
+}
+
+/*Stops a timer and gives its slot back for a new timer*/
+void Timer_Delete(TIMER id)
+{
+	unsigned char sreg = SREG;
+	TIMER_TYPE *t;
+	
+	Disable_Interrupt();
+	t = findTimerByTimerID(id);
+	if(t != NULL)
+	{
+		if(t->slot != TIMER_STOPPED)
+			Timer_Unlink(t);
+		t->id = 0;
+		--Timer_Count;
+		err = NO_ERR;
+	}
+	SREG = sreg;
+}
@@ -0,0 +1,37 @@
+/***********************************************************************
+  Timer.h and Timer.c provide software timers on top of the kernel.
+  Their callbacks all run in one timer service task, so a timed activity costs a TIMER_TYPE instead of a task and its stack.
+  Running timers are kept in a hashed timer wheel: a timer expiring at tick t is linked into slot t % TIMER_WHEEL_SIZE,
+  so starting and stopping one takes constant time, and each tick only looks at the timers of one slot.
+  ***********************************************************************/
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include "os.h"
+
+#define TIMER_WHEEL_SIZE 16		//Number of slots in the timer wheel. Must be a power of 2 and at most 254.
+#define TIMER_PRIORITY 1		//Priority of the timer service task, i.e. of every timer callback
+#define TIMER_STACK_SIZE 128	//Stack size of the timer service task in bytes. The callbacks run on it.
+#define TIMER_STOPPED 0xFF		//Slot of a timer that isn't running
+#define TIMER_PENDING 0xFE		//Slot of a timer that has expired, and whose callback is about to be called
+
+#if TIMER_WHEEL_SIZE & (TIMER_WHEEL_SIZE - 1)
+	#error "TIMER_WHEEL_SIZE must be a power of 2"
+#endif
+
+typedef struct timer_type
+{
+	TIMER id;								//An unique identifier for this timer, made from its slot index and generation. 0 = uninitialized
+	unsigned char gen;						//Generation of this slot, bumped every time a timer is created in it.
+	unsigned char mode;						//TIMER_ONE_SHOT or TIMER_AUTO_RELOAD
+	unsigned char slot;						//The wheel slot the timer is linked into, TIMER_PENDING or TIMER_STOPPED
+	timerfuncptr callback;					//Called by the timer service task when the timer expires
+	int arg;								//Passed to the callback
+	TICK period;							//Ticks from the start of the timer until it expires, and between the expiries of an auto-reload timer
+	TICK expiry;							//Tick the timer expires at while it's running
+	struct timer_type *next;				//Next timer in the same wheel slot (or pending list)
+	struct timer_type *prev;				//Previous timer in the same wheel slot (or pending list)
+} TIMER_TYPE;
+
+#endif /* TIMER_H_ */
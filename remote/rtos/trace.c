@@ -0,0 +1,71 @@
+#include "kernel.h"
+#include "trace.h"
+#include "../uart/uart.h"
+
+#ifdef OS_TRACE
+
+/*Trace variables, written by Trace() in the kernel and in interrupt handlers*/
+volatile TRACE_RECORD Trace_Buffer[TRACE_SIZE];	//Ring buffer of the most recent records
+volatile unsigned char Trace_Head;				//Index where the next record goes
+volatile unsigned char Trace_Count;				//Number of records in the buffer, up to TRACE_SIZE
+volatile unsigned char Trace_Enabled = 1;		//Cleared while the buffer is being sent
+volatile unsigned int Trace_Dropped;			//Records lost to overwriting or while the buffer was being sent, since the last dump
+
+/*Stores a 16-bit value, lower-order byte first*/
+static void Trace_Put_Word(unsigned char *buf, unsigned int w)
+{
+	buf[0] = w & 0xFF;
+	buf[1] = w >> 8;
+}
+
+/*
+ * Streams the trace buffer over UART0, oldest record first, and empties it. 
+ * Format: 'T' 'R', record count (1 byte), dropped records (2 bytes), TICK_LENG (2 bytes), then the records as laid out in TRACE_RECORD.
+ * Sending takes much longer than a tick, so recording is paused meanwhile instead of keeping interrupts disabled.
+ * The header and every record are queued as one UART command each, so bytes other tasks send on UART0 can't end up inside them.
+ * Calling this periodically from a low priority task gives a continuous stream.
+ */
+void Trace_Dump()
+{
+	unsigned char sreg;
+	unsigned char i;
+	unsigned char first;
+	unsigned char count;
+	unsigned int dropped;
+	unsigned char buf[7];
+	volatile TRACE_RECORD *r;
+	
+	sreg = SREG;
+	Disable_Interrupt();
+	Trace_Enabled = 0;
+	count = Trace_Count;
+	first = (Trace_Head - count) & (TRACE_SIZE - 1);
+	dropped = Trace_Dropped;
+	Trace_Dropped = 0;
+	SREG = sreg;
+	
+	buf[0] = TRACE_MAGIC0;
+	buf[1] = TRACE_MAGIC1;
+	buf[2] = count;
+	Trace_Put_Word(&buf[3], dropped);
+	Trace_Put_Word(&buf[5], TICK_LENG);
+	uart0_sendcmd(buf, 7, UART_LANE_NORMAL);
+	
+	for(i = 0; i < count; i++)
+	{
+		r = &Trace_Buffer[(first + i) & (TRACE_SIZE - 1)];
+		buf[0] = r->type;
+		buf[1] = r->task;
+		buf[2] = r->arg;
+		Trace_Put_Word(&buf[3], r->stamp);
+		uart0_sendcmd(buf, 5, UART_LANE_NORMAL);
+	}
+	
+	sreg = SREG;
+	Disable_Interrupt();
+	Trace_Count = 0;
+	Trace_Enabled = 1;
+	SREG = sreg;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/***********************************************************************
+  Trace.h and Trace.c record a timeline of the scheduler into a RAM ring buffer.
+  Each record is 5 bytes: what happened, to which task, an argument and the Timer1 count at that moment.
+  The buffer is streamed over UART0 by Trace_Dump() and decoded on the host by tools/trace_decode.py.
+  ***********************************************************************/
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <avr/io.h>
+
+//Comment out to compile the scheduler trace out
+#define OS_TRACE
+
+#define TRACE_SIZE 64			//Number of records kept in the ring buffer. Must be a power of 2 and at most 128.
+#define TRACE_NO_TASK 0xFF		//Task field of records that don't belong to any task
+#define TRACE_MAGIC0 'T'		//Every dump starts with these two bytes, so the host can find it in the stream
+#define TRACE_MAGIC1 'R'
+
+//What a trace record stands for. Must match RECORD_TYPES in tools/trace_decode.py.
+typedef enum trace_type
+{
+	TRACE_TICK = 0,				//Timer1 compare match. arg = ticks covered by the period that just ended
+	TRACE_REQUEST,				//A task entered the kernel. arg = its KERNEL_REQUEST_TYPE
+	TRACE_ISR_REQUEST,			//The kernel carried out a request made by an interrupt handler. arg = its KERNEL_REQUEST_TYPE
+	TRACE_SWITCH_OUT,			//The running task was taken off the CPU. arg = its new PROCESS_STATES, i.e. why it stopped
+	TRACE_SWITCH_IN,			//A task was picked to run. arg = its priority
+	TRACE_WAKE,					//A task became READY. arg = the PROCESS_STATES it was in before
+	TRACE_IDLE					//No task was ready and the kernel went idle
+} TRACE_TYPE;
+
+/*A single trace record. Only the low 16 bits of time are stored: the TICK records tell the host how many ticks passed.*/
+typedef struct trace_record
+{
+	unsigned char type;						//A TRACE_TYPE
+	unsigned char task;						//Slot index of the task concerned, TRACE_NO_TASK if none
+	unsigned char arg;						//Meaning depends on the type
+	unsigned int stamp;						//TCNT1 when the record was made
+} TRACE_RECORD;
+
+#ifdef OS_TRACE
+
+extern volatile TRACE_RECORD Trace_Buffer[TRACE_SIZE];
+extern volatile unsigned char Trace_Head;
+extern volatile unsigned char Trace_Count;
+extern volatile unsigned char Trace_Enabled;
+extern volatile unsigned int Trace_Dropped;
+
+//Every ring buffer index is masked with TRACE_SIZE - 1
+#if (TRACE_SIZE & (TRACE_SIZE - 1)) != 0 || TRACE_SIZE > 128
+	#error "TRACE_SIZE must be a power of 2 and at most 128"
+#endif
+
+/*Adds a record to the ring buffer, overwriting the oldest one if it's full. Interrupts must be disabled, as they are in the kernel and in interrupt handlers.*/
+static inline void Trace(TRACE_TYPE type, unsigned char task, unsigned char arg)
+{
+	volatile TRACE_RECORD *r;
+	
+	if(!Trace_Enabled)
+	{
+		++Trace_Dropped;
+		return;
+	}
+	
+	r = &Trace_Buffer[Trace_Head];
+	r->type = type;
+	r->task = task;
+	r->arg = arg;
+	r->stamp = TCNT1;
+	Trace_Head = (Trace_Head + 1) & (TRACE_SIZE - 1);
+	if(Trace_Count < TRACE_SIZE)
+		++Trace_Count;
+	else
+		++Trace_Dropped;
+}
+
+void Trace_Dump();
+
+#else
+
+#define Trace(type, task, arg)
+#define Trace_Dump()
+
+#endif
+
+#endif /* TRACE_H_ */
@@ -7,6 +7,7 @@
 #include "adc/adc.h"
 #include "rtos/os.h"
 #include "rtos/kernel.h"
+#include "rtos/trace.h"
 
 //Preamble and postamble used by basestation to wrap data
 #define CMD_PREAMBLE			'$'
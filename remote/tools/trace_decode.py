@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""
+Decodes the scheduler trace streamed by Trace_Dump() (rtos/trace.c) over UART0.
+
+Usage:
+    trace_decode.py /dev/ttyUSB0 [--baud 19200] [--chrome trace.json]
+    trace_decode.py capture.bin [--chrome trace.json]
+
+Prints a readable timeline and, with --chrome, writes a trace file that can be
+opened in chrome://tracing or https://ui.perfetto.dev.
+Reading from a serial port needs pyserial; stop the capture with Ctrl-C.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"TR"
+HEADER = struct.Struct("<BHH")      # record count, dropped records, TICK_LENG
+RECORD = struct.Struct("<BBBH")     # type, task, arg, TCNT1 stamp
+US_PER_COUNT = 16                   # Timer1 runs at 16MHz / 256
+NO_TASK = 0xFF
+
+# Must match TRACE_TYPE in rtos/trace.h
+RECORD_TYPES = ["TICK", "REQUEST", "ISR_REQUEST", "SWITCH_OUT", "SWITCH_IN", "WAKE", "IDLE"]
+
+# Must match KERNEL_REQUEST_TYPE and PROCESS_STATES in rtos/kernel.h
+REQUESTS = ["NONE", "CREATE_T", "YIELD", "TERMINATE", "SUSPEND", "RESUME", "SLEEP",
+            "CREATE_E", "WAIT_E", "SIGNAL_E", "CREATE_M", "LOCK_M", "UNLOCK_M",
+            "CREATE_S", "WAIT_S", "POST_S", "CREATE_Q", "SEND_Q", "RECEIVE_Q", "ALLOC_MSG", "FREE_MSG",
+            "CREATE_F", "WAIT_F", "SET_F", "CLEAR_F", "SLEEP_UNTIL", "NEXT_PERIOD", "PREEMPT"]
+STATES = ["DEAD", "READY", "RUNNING", "SUSPENDED", "SLEEPING", "WAIT_EVENT", "WAIT_MUTEX", "WAIT_SEM",
+          "WAIT_SEND", "WAIT_RECEIVE", "WAIT_BUFFER", "WAIT_FLAGS"]
+
+
+def name(table, value):
+    return table[value] if value < len(table) else str(value)
+
+
+def task_name(task):
+    return "kernel" if task == NO_TASK else "task %d" % task
+
+
+def read_dumps(stream):
+    """Yields (dropped, tick_leng, records) for every dump found in the byte stream."""
+    buf = b""
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            return
+        buf += chunk
+        while True:
+            start = buf.find(MAGIC)
+            if start < 0:
+                buf = buf[-1:]
+                break
+            end = start + len(MAGIC) + HEADER.size
+            if len(buf) < end:
+                buf = buf[start:]
+                break
+            count, dropped, tick_leng = HEADER.unpack_from(buf, start + len(MAGIC))
+            if len(buf) < end + count * RECORD.size:
+                buf = buf[start:]
+                break
+            records = [RECORD.unpack_from(buf, end + i * RECORD.size) for i in range(count)]
+            buf = buf[end + count * RECORD.size:]
+            yield dropped, tick_leng, records
+
+
+class Timeline:
+    """Turns records into absolute times and keeps what's needed for the Chrome trace."""
+
+    def __init__(self):
+        self.ticks = 0              # ticks elapsed before the current one
+        self.last_stamp = 0
+        self.wrapped = False        # a tick boundary was passed before its TICK record showed up
+        self.cause = "boot"         # what the last thing to wake tasks up was
+        self.running = None         # (task, start time) of the task on the CPU
+        self.idle_since = None
+        self.events = []
+
+    def time_us(self, rtype, arg, stamp, tick_leng):
+        if rtype == 0:
+            # The record of a tick is made after Timer1 restarted from 0
+            self.ticks += arg - 1 if self.wrapped else arg
+            self.wrapped = False
+        elif stamp < self.last_stamp:
+            # Interrupts were disabled across a tick boundary, its TICK record comes later
+            self.ticks += 1
+            self.wrapped = True
+        self.last_stamp = stamp
+        return (self.ticks * tick_leng + stamp) * US_PER_COUNT
+
+    def describe(self, rtype, task, arg):
+        if rtype == 0:
+            self.cause = "tick"
+            return "TICK        %d tick(s), running: %s" % (arg, task_name(task))
+        if rtype == 1:
+            self.cause = task_name(task)
+            return "REQUEST     %s by %s" % (name(REQUESTS, arg), task_name(task))
+        if rtype == 2:
+            self.cause = "ISR"
+            return "ISR_REQUEST %s" % name(REQUESTS, arg)
+        if rtype == 3:
+            return "SWITCH_OUT  %s -> %s" % (task_name(task), name(STATES, arg))
+        if rtype == 4:
+            return "SWITCH_IN   %s (priority %d)" % (task_name(task), arg)
+        if rtype == 5:
+            return "WAKE        %s from %s, woken by %s" % (task_name(task), name(STATES, arg), self.cause)
+        if rtype == 6:
+            return "IDLE"
+        return "UNKNOWN     type %d task %d arg %d" % (rtype, task, arg)
+
+    def add(self, t, rtype, task, arg):
+        """Collects Chrome trace events: running intervals per task, idle intervals and instants."""
+        if rtype == 3 and self.running is not None:
+            task_run, start = self.running
+            self.events.append({"name": name(STATES, arg), "ph": "X", "pid": 0, "tid": task_run,
+                                "ts": start, "dur": t - start, "cat": "run"})
+            self.running = None
+        elif rtype == 4:
+            if self.idle_since is not None:
+                self.events.append({"name": "idle", "ph": "X", "pid": 0, "tid": NO_TASK,
+                                    "ts": self.idle_since, "dur": t - self.idle_since, "cat": "idle"})
+                self.idle_since = None
+            self.running = (task, t)
+        elif rtype == 6:
+            self.idle_since = t
+        elif rtype in (1, 2, 5):
+            args = {"request": name(REQUESTS, arg)} if rtype != 5 else {"from": name(STATES, arg), "by": self.cause}
+            self.events.append({"name": name(RECORD_TYPES, rtype), "ph": "i", "s": "t", "pid": 0,
+                                "tid": task, "ts": t, "args": args})
+
+    def chrome_trace(self):
+        threads = sorted({e["tid"] for e in self.events})
+        meta = [{"name": "thread_name", "ph": "M", "pid": 0, "tid": tid, "args": {"name": task_name(tid)}}
+                for tid in threads]
+        return {"traceEvents": meta + self.events, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="serial port or captured binary file")
+    parser.add_argument("--baud", type=int, default=19200, help="baud rate of the serial port (default 19200)")
+    parser.add_argument("--chrome", metavar="FILE", help="also write a Chrome/Perfetto trace to FILE")
+    options = parser.parse_args()
+
+    if options.input.startswith("/dev/") or options.input.upper().startswith("COM"):
+        import serial
+        stream = serial.Serial(options.input, options.baud, timeout=1)
+    else:
+        stream = open(options.input, "rb")
+
+    timeline = Timeline()
+    try:
+        for dropped, tick_leng, records in read_dumps(stream):
+            if dropped:
+                print("---- %d record(s) dropped, times may be off from here ----" % dropped)
+            for rtype, task, arg, stamp in records:
+                t = timeline.time_us(rtype, arg, stamp, tick_leng)
+                line = timeline.describe(rtype, task, arg)
+                timeline.add(t, rtype, task, arg)
+                print("%12.3f ms  %s" % (t / 1000.0, line))
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        stream.close()
+
+    if options.chrome:
+        with open(options.chrome, "w") as f:
+            json.dump(timeline.chrome_trace(), f)
+
+
+if __name__ == "__main__":
+    main()
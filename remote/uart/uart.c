@@ -1,9 +1,283 @@
 #include "uart.h"
+#include <avr/interrupt.h>
+#include <string.h>
 
 /*Used for redirection streams*/
 FILE uart_output = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
 FILE uart_input = FDEV_SETUP_STREAM(NULL, uart_getchar, _FDEV_SETUP_READ);
 
+/*Receive side of a port. The RX complete ISR adds bytes at head, tasks take them from tail.*/
+typedef struct
+{
+	uint8_t buf[UART_RX_SIZE];
+	uint8_t head;
+	uint8_t tail;
+	uint8_t waiting;			//Set by a reader that found the buffer empty, so the ISR posts ready for the next byte
+	SEMAPHORE ready;			//Posted by the ISR to wake the reader up
+	UART_RX_STATS stats;
+} UART_RX;
+
+/*One lane of a port's transmit queue. Each command in it is stored as its length followed by its bytes.*/
+typedef struct
+{
+	uint8_t *buf;
+	uint8_t mask;				//Size of buf - 1
+	uint8_t head;
+	uint8_t tail;
+} UART_LANE;
+
+/*Transmit side of a port. Tasks queue commands, the UDRE ISR sends them.*/
+typedef struct
+{
+	UART_LANE lane[2];			//Indexed by UART_LANE_NORMAL and UART_LANE_URGENT
+	uint8_t sending;			//Lane of the command being sent
+	uint8_t left;				//Bytes of that command still to be sent, 0 between commands
+	uint8_t waiting;			//Set by a writer that found its lane full, so the ISR posts room once a byte is sent
+	SEMAPHORE room;				//Posted by the ISR to wake the writer up
+	volatile uint8_t *ucsra;	//Registers of the port
+	volatile uint8_t *ucsrb;
+	volatile uint8_t *udr;
+} UART_TX;
+
+static volatile UART_RX Rx0;
+static volatile UART_RX Rx1;
+
+static uint8_t Tx0_Buf[UART_TX_SIZE];
+static uint8_t Tx0_Urgent_Buf[UART_TX_URGENT_SIZE];
+static uint8_t Tx1_Buf[UART_TX_SIZE];
+static uint8_t Tx1_Urgent_Buf[UART_TX_URGENT_SIZE];
+static volatile UART_TX Tx0;
+static volatile UART_TX Tx1;
+
+/*Resets the receive side of a port, and creates the semaphore its readers block on*/
+static void uart_rx_init(volatile UART_RX *rx)
+{
+	rx->head = 0;
+	rx->tail = 0;
+	rx->waiting = 0;
+	rx->stats.overruns = 0;
+	rx->stats.frame_errors = 0;
+	rx->stats.dropped = 0;
+	if(rx->ready == 0)
+		rx->ready = Sem_Init(0);
+}
+
+/*Called by the RX complete ISRs. The status has to be read before the data, since reading UDR moves the next byte's flags in.*/
+static void uart_rx_store(volatile UART_RX *rx, uint8_t status, uint8_t data)
+{
+	uint8_t next;
+	
+	//FE and DOR sit at the same bit in both ports
+	if(status & (1<<DOR0))
+		++rx->stats.overruns;
+	if(status & (1<<FE0))
+	{
+		++rx->stats.frame_errors;
+		return;
+	}
+	
+	next = (rx->head + 1) & (UART_RX_SIZE - 1);
+	if(next == rx->tail)
+	{
+		++rx->stats.dropped;
+		return;
+	}
+	rx->buf[rx->head] = data;
+	rx->head = next;
+	
+	//Only one post per wait, so a burst of bytes can't fill up the kernel's queue of ISR requests
+	if(rx->waiting)
+	{
+		rx->waiting = 0;
+		Sem_Post_FromISR(rx->ready);
+	}
+}
+
+/*Takes the next byte out of a port's buffer, blocking the calling task until one arrives*/
+static uint8_t uart_rx_get(volatile UART_RX *rx)
+{
+	uint8_t sreg;
+	uint8_t data;
+	
+	while(1)
+	{
+		sreg = SREG;
+		cli();
+		if(rx->head != rx->tail)
+		{
+			data = rx->buf[rx->tail];
+			rx->tail = (rx->tail + 1) & (UART_RX_SIZE - 1);
+			SREG = sreg;
+			return data;
+		}
+		rx->waiting = 1;
+		SREG = sreg;
+		
+		//A stale post only makes us look at the buffer once more. Should the ISR's post get lost, we look again after UART_RX_RECHECK ticks.
+		Sem_Wait_Timeout(rx->ready, UART_RX_RECHECK);
+	}
+}
+
+/*Copies the error counters of a port*/
+static void uart_rx_stats(volatile UART_RX *rx, UART_RX_STATS *stats)
+{
+	uint8_t sreg = SREG;
+	
+	cli();
+	stats->overruns = rx->stats.overruns;
+	stats->frame_errors = rx->stats.frame_errors;
+	stats->dropped = rx->stats.dropped;
+	SREG = sreg;
+}
+
+/*Resets the transmit side of a port, and creates the semaphore its writers block on*/
+static void uart_tx_init(volatile UART_TX *tx, uint8_t *buf, uint8_t *urgent_buf, volatile uint8_t *ucsra, volatile uint8_t *ucsrb, volatile uint8_t *udr)
+{
+	tx->lane[UART_LANE_NORMAL].buf = buf;
+	tx->lane[UART_LANE_NORMAL].mask = UART_TX_SIZE - 1;
+	tx->lane[UART_LANE_URGENT].buf = urgent_buf;
+	tx->lane[UART_LANE_URGENT].mask = UART_TX_URGENT_SIZE - 1;
+	tx->lane[UART_LANE_NORMAL].head = tx->lane[UART_LANE_NORMAL].tail = 0;
+	tx->lane[UART_LANE_URGENT].head = tx->lane[UART_LANE_URGENT].tail = 0;
+	tx->left = 0;
+	tx->waiting = 0;
+	tx->ucsra = ucsra;
+	tx->ucsrb = ucsrb;
+	tx->udr = udr;
+	if(tx->room == 0)
+		tx->room = Sem_Init(0);
+}
+
+/*Takes the next byte out of a lane*/
+static uint8_t uart_lane_take(volatile UART_LANE *l)
+{
+	uint8_t data = l->buf[l->tail];
+	
+	l->tail = (l->tail + 1) & l->mask;
+	return data;
+}
+
+/*
+ * Writes the next queued byte to UDR, which must be empty. Called with interrupts disabled.
+ * A new command is taken from the urgent lane first, so an urgent one only ever waits for the command being sent.
+ * Returns 0 if nothing is queued.
+ */
+static uint8_t uart_tx_next(volatile UART_TX *tx)
+{
+	if(tx->left == 0)
+	{
+		if(tx->lane[UART_LANE_URGENT].head != tx->lane[UART_LANE_URGENT].tail)
+			tx->sending = UART_LANE_URGENT;
+		else if(tx->lane[UART_LANE_NORMAL].head != tx->lane[UART_LANE_NORMAL].tail)
+			tx->sending = UART_LANE_NORMAL;
+		else
+			return 0;
+		tx->left = uart_lane_take(&tx->lane[tx->sending]);
+	}
+	
+	*tx->udr = uart_lane_take(&tx->lane[tx->sending]);
+	--tx->left;
+	
+	if(tx->waiting)
+	{
+		tx->waiting = 0;
+		Sem_Post_FromISR(tx->room);
+	}
+	return 1;
+}
+
+/*Queues a command of at most mask - 1 bytes on a lane of a port, blocking the calling task while there's no room for it*/
+static void uart_tx_put_cmd(volatile UART_TX *tx, volatile UART_LANE *l, const uint8_t *data, uint8_t len)
+{
+	uint8_t sreg;
+	uint8_t i;
+	
+	while(1)
+	{
+		sreg = SREG;
+		cli();
+		
+		//The ISR can't run, so send whatever is queued and then the command by polling
+		if(!(sreg & (1<<SREG_I)))
+		{
+			do
+			{
+				while(!(*tx->ucsra & (1<<UDRE0)));
+			}
+			while(uart_tx_next(tx));
+			
+			for(i = 0; i < len; i++)
+			{
+				while(!(*tx->ucsra & (1<<UDRE0)));
+				*tx->udr = data[i];
+			}
+			SREG = sreg;
+			return;
+		}
+		
+		//The lane holds mask bytes at most
+		if(l->mask - ((l->head - l->tail) & l->mask) > len)
+		{
+			l->buf[l->head] = len;
+			l->head = (l->head + 1) & l->mask;
+			for(i = 0; i < len; i++)
+			{
+				l->buf[l->head] = data[i];
+				l->head = (l->head + 1) & l->mask;
+			}
+			*tx->ucsrb |= (1<<UDRIE0);		//UDRIE sits at the same bit in both ports
+			SREG = sreg;
+			return;
+		}
+		tx->waiting = 1;
+		SREG = sreg;
+		
+		Sem_Wait_Timeout(tx->room, UART_TX_RECHECK);
+	}
+}
+
+/*Queues bytes on a lane of a port. More than fit in the lane at once are queued as several commands.*/
+static void uart_tx_put(volatile UART_TX *tx, uint8_t lane, const uint8_t *data, uint16_t len)
+{
+	volatile UART_LANE *l = &tx->lane[lane == UART_LANE_URGENT ? UART_LANE_URGENT : UART_LANE_NORMAL];
+	uint8_t n;
+	
+	while(len > 0)
+	{
+		n = len < l->mask - 1 ? len : l->mask - 1;
+		uart_tx_put_cmd(tx, l, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+ISR(USART0_RX_vect)
+{
+	uint8_t status = UCSR0A;
+	
+	uart_rx_store(&Rx0, status, UDR0);
+}
+
+ISR(USART1_RX_vect)
+{
+	uint8_t status = UCSR1A;
+	
+	uart_rx_store(&Rx1, status, UDR1);
+}
+
+/*UDR is empty. Once nothing is left to send, this interrupt is turned off until the next command is queued.*/
+ISR(USART0_UDRE_vect)
+{
+	if(!uart_tx_next(&Tx0))
+		UCSR0B &= ~_BV(UDRIE0);
+}
+
+ISR(USART1_UDRE_vect)
+{
+	if(!uart_tx_next(&Tx1))
+		UCSR1B &= ~_BV(UDRIE1);
+}
+
 void uart0_init(void) {
 	UBRR0H = UBRRH_VALUE;
 	UBRR0L = UBRRL_VALUE;
@@ -14,8 +288,10 @@ void uart0_init(void) {
 	UCSR0A &= ~(_BV(U2X0));
 	#endif
 
+	uart_rx_init(&Rx0);
+	uart_tx_init(&Tx0, Tx0_Buf, Tx0_Urgent_Buf, &UCSR0A, &UCSR0B, &UDR0);
 	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); /* 8-bit data */
-	UCSR0B = _BV(RXEN0) | _BV(TXEN0);   /* Enable RX and TX */
+	UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);   /* Enable RX and TX, interrupt on every received byte */
 }
 
 void uart1_init(void) {
@@ -28,31 +304,43 @@ void uart1_init(void) {
 	UCSR1A &= ~(_BV(U2X1));
 	#endif
 
+	uart_rx_init(&Rx1);
+	uart_tx_init(&Tx1, Tx1_Buf, Tx1_Urgent_Buf, &UCSR1A, &UCSR1B, &UDR1);
 	UCSR1C = _BV(UCSZ11) | _BV(UCSZ10); /* 8-bit data */
-	UCSR1B = _BV(RXEN1) | _BV(TXEN1);   /* Enable RX and TX */
+	UCSR1B = _BV(RXEN1) | _BV(TXEN1) | _BV(RXCIE1);   /* Enable RX and TX, interrupt on every received byte */
 }
 
 /*Simple Send/Receive characters without streams*/
 
 void uart0_sendbyte(uint8_t data)
 {
-	while(!(UCSR0A & (1<<UDRE0)));
-	UDR0 = data;
+	uart_tx_put(&Tx0, UART_LANE_NORMAL, &data, 1);
 }
 
-uint8_t uart0_recvbyte(void)
+void uart0_sendcmd(const uint8_t *cmd, uint8_t len, uint8_t lane)
 {
-	while(!(UCSR0A & (1<<RXC0)));
-	return UDR0;
+	uart_tx_put(&Tx0, lane, cmd, len);
 }
 
-void uart0_sendstr(char* input)
+/*Blocks the calling task until a byte arrives. Before OS_Start interrupts are still off, so the byte is polled from the hardware instead.*/
+uint8_t uart0_recvbyte(void)
 {
-	while(*input != 0x00)
+	if(!(SREG & (1<<SREG_I)) && Rx0.head == Rx0.tail)
 	{
-		uart0_sendbyte(*input);
-		input++;
+		while(!(UCSR0A & (1<<RXC0)));
+		return UDR0;
 	}
+	return uart_rx_get(&Rx0);
+}
+
+void uart0_sendstr(char* input)
+{
+	uart_tx_put(&Tx0, UART_LANE_NORMAL, (const uint8_t*)input, strlen(input));
+}
+
+void uart0_rxstats(UART_RX_STATS *stats)
+{
+	uart_rx_stats(&Rx0, stats);
 }
 
 //NEEDS TESTING
@@ -74,23 +362,32 @@ int uart0_recvuntil(char* input, char end_char, uint8_t max_chars)
 
 void uart1_sendbyte(uint8_t data)
 {
-	while(!(UCSR1A & (1<<UDRE1)));
-	UDR1 = data;
+	uart_tx_put(&Tx1, UART_LANE_NORMAL, &data, 1);
 }
 
-uint8_t uart1_recvbyte(void)
+void uart1_sendcmd(const uint8_t *cmd, uint8_t len, uint8_t lane)
 {
-	while(!(UCSR1A & (1<<RXC1)));
-	return UDR1;
+	uart_tx_put(&Tx1, lane, cmd, len);
 }
 
-void uart1_sendstr(char* input)
+uint8_t uart1_recvbyte(void)
 {
-	while(*input != 0x00)
+	if(!(SREG & (1<<SREG_I)) && Rx1.head == Rx1.tail)
 	{
-		uart1_sendbyte(*input);
-		input++;
+		while(!(UCSR1A & (1<<RXC1)));
+		return UDR1;
 	}
+	return uart_rx_get(&Rx1);
+}
+
+void uart1_sendstr(char* input)
+{
+	uart_tx_put(&Tx1, UART_LANE_NORMAL, (const uint8_t*)input, strlen(input));
+}
+
+void uart1_rxstats(UART_RX_STATS *stats)
+{
+	uart_rx_stats(&Rx1, stats);
 }
 
 
@@ -99,13 +396,11 @@ void uart_putchar(char c, FILE *stream) {
 	if (c == '\n') {
 		uart_putchar('\r', stream);
 	}
-	loop_until_bit_is_set(UCSR0A, UDRE0);
-	UDR0 = c;
+	uart0_sendbyte(c);
 }
 
 char uart_getchar(FILE *stream) {
-	loop_until_bit_is_set(UCSR0A, RXC0);
-	return UDR0;
+	return uart0_recvbyte();
 }
 
 void uart_setredir(void)
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <util/setbaud.h>
 #include <avr/sfr_defs.h>
+#include "../rtos/os.h"
 
 #ifndef F_CPU
 	#define F_CPU 16000000UL
@@ -19,6 +20,33 @@
 	#define BAUD 19200
 #endif
 
+#define UART_RX_SIZE 32		//Bytes each port buffers until a task reads them. Must be a power of 2 and at most 256.
+#define UART_TX_SIZE 64		//Bytes each port queues for sending in its normal lane. Every queued command takes one more byte for its length. Must be a power of 2 and at most 256.
+#define UART_TX_URGENT_SIZE 16	//The same for the urgent lane
+#define UART_RX_RECHECK 10	//Ticks a blocked reader waits before looking at its buffer again, in case its wake-up got lost
+#define UART_TX_RECHECK 10	//The same for a writer waiting for room
+
+#if UART_RX_SIZE & (UART_RX_SIZE - 1)
+	#error "UART_RX_SIZE must be a power of 2"
+#endif
+
+#if (UART_TX_SIZE & (UART_TX_SIZE - 1)) || (UART_TX_URGENT_SIZE & (UART_TX_URGENT_SIZE - 1))
+	#error "UART_TX_SIZE and UART_TX_URGENT_SIZE must be powers of 2"
+#endif
+
+// lanes of uartN_sendcmd
+#define UART_LANE_NORMAL  0   // sent in the order queued
+#define UART_LANE_URGENT  1   // sent ahead of everything in the normal lane, though never in the middle of a command
+
+/*Receive error counters of a port, since it was initialized*/
+typedef struct
+{
+	unsigned int overruns;		//Bytes the hardware lost because the next one arrived before the ISR read UDR
+	unsigned int frame_errors;	//Bytes thrown away because their stop bit was missing
+	unsigned int dropped;		//Bytes thrown away because the ring buffer was full
+} UART_RX_STATS;
+
+/*Both create semaphores, so they must be called after OS_Init*/
 void uart0_init(void);
 void uart1_init(void);
 
@@ -26,12 +54,21 @@ void uart_putchar(char c, FILE *stream);
 char uart_getchar(FILE *stream);
 void uart_setredir(void);
 
+/*
+ * The send calls queue their bytes and return, and an interrupt sends them. They only wait while the lane is full.
+ * With interrupts disabled (e.g. before OS_Start) they send by polling instead.
+ * A command of up to the lane size - 2 bytes goes out whole, even if other tasks send on the same port.
+ */
 void uart0_sendbyte(uint8_t data);
+void uart0_sendcmd(const uint8_t *cmd, uint8_t len, uint8_t lane);
 uint8_t uart0_recvbyte(void);
 void uart0_sendstr(char* input);
+void uart0_rxstats(UART_RX_STATS *stats);
 
 void uart1_sendbyte(uint8_t data);
+void uart1_sendcmd(const uint8_t *cmd, uint8_t len, uint8_t lane);
 uint8_t uart1_recvbyte(void);
 void uart1_sendstr(char* input);
+void uart1_rxstats(UART_RX_STATS *stats);
 
 #endif
\ No newline at end of file